@@ -0,0 +1,213 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Playback clock:
+ * Seeded from a status object, extrapolates the elapsed time from the
+ * monotonic clock instead of polling the server. Resynchronise on
+ * MPD_IDLE_PLAYER events with on_idle().
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/idle.h>
+#include <mpd/status.h>
+
+#include "globals.h"
+
+struct lmpd_clock {
+	/* elapsed seconds at the time of the last sync */
+	double elapsed;
+	/* monotonic time of the last sync */
+	double synced_at;
+	unsigned total_time;
+	int song_id;
+	enum mpd_state state;
+};
+
+double lmpd_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void lmpdclock_sync_status(struct lmpd_clock *clk, const struct mpd_status *status)
+{
+	unsigned ms;
+
+	/* elapsed_ms is zero when the server sends no fractional time */
+	ms = mpd_status_get_elapsed_ms(status);
+	if (ms != 0)
+		clk->elapsed = ms / 1000.0;
+	else
+		clk->elapsed = mpd_status_get_elapsed_time(status);
+	clk->synced_at = lmpd_monotonic();
+	clk->total_time = mpd_status_get_total_time(status);
+	clk->song_id = mpd_status_get_song_id(status);
+	clk->state = mpd_status_get_state(status);
+}
+
+static double lmpdclock_elapsed(const struct lmpd_clock *clk)
+{
+	double elapsed;
+
+	if (clk->state != MPD_STATE_PLAY)
+		return clk->elapsed;
+
+	elapsed = clk->elapsed + (lmpd_monotonic() - clk->synced_at);
+	if (clk->total_time > 0 && elapsed > clk->total_time)
+		elapsed = clk->total_time;
+	return elapsed;
+}
+
+static int lmpdclock_new(lua_State *L)
+{
+	struct lmpd_clock *clk;
+	struct mpd_status **status;
+
+	clk = (struct lmpd_clock *) lua_newuserdata(L, sizeof(struct lmpd_clock));
+	memset(clk, 0, sizeof(struct lmpd_clock));
+	clk->song_id = -1;
+	clk->state = MPD_STATE_UNKNOWN;
+	luaL_getmetatable(L, MPD_CLOCK_T);
+	lua_setmetatable(L, -2);
+
+	if (!lua_isnoneornil(L, 1)) {
+		status = luaL_checkudata(L, 1, MPD_STATUS_T);
+		assert(*status != NULL);
+		lmpdclock_sync_status(clk, *status);
+	}
+
+	return 1;
+}
+
+static int lmpdclock_sync(lua_State *L)
+{
+	struct lmpd_clock *clk;
+	struct mpd_status **status;
+
+	clk = luaL_checkudata(L, 1, MPD_CLOCK_T);
+	status = luaL_checkudata(L, 2, MPD_STATUS_T);
+
+	assert(*status != NULL);
+
+	lmpdclock_sync_status(clk, *status);
+	return 0;
+}
+
+static int lmpdclock_on_idle(lua_State *L)
+{
+	int idle;
+	struct lmpd_clock *clk;
+	struct mpd_connection **conn;
+	struct mpd_status *status;
+
+	clk = luaL_checkudata(L, 1, MPD_CLOCK_T);
+	conn = lmpdconn_check(L, 2);
+	idle = luaL_checkinteger(L, 3);
+
+	assert(*conn != NULL);
+
+	if (!(idle & MPD_IDLE_PLAYER)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	status = mpd_run_status(*conn);
+	if (status == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lmpdclock_sync_status(clk, status);
+	mpd_status_free(status);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lmpdclock_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_clock *clk;
+
+	clk = luaL_checkudata(L, 1, MPD_CLOCK_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "sync", 5) == 0)
+		lua_pushcfunction(L, lmpdclock_sync);
+	else if (strncmp(key, "on_idle", 8) == 0)
+		lua_pushcfunction(L, lmpdclock_on_idle);
+	else if (strncmp(key, "elapsed", 8) == 0)
+		lua_pushnumber(L, lmpdclock_elapsed(clk));
+	else if (strncmp(key, "elapsed_ms", 11) == 0)
+		lua_pushinteger(L, (lua_Integer) (lmpdclock_elapsed(clk) * 1000));
+	else if (strncmp(key, "elapsed_time", 13) == 0)
+		lua_pushinteger(L, (lua_Integer) lmpdclock_elapsed(clk));
+	else if (strncmp(key, "total_time", 11) == 0)
+		lua_pushinteger(L, clk->total_time);
+	else if (strncmp(key, "song_id", 8) == 0)
+		lua_pushinteger(L, clk->song_id);
+	else if (strncmp(key, "state", 6) == 0)
+		lua_pushinteger(L, clk->state);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static const luaL_reg lreg_clock[] = {
+	{"__index",	lmpdclock_index},
+	{NULL,		NULL},
+};
+
+void linit_clock(lua_State *L)
+{
+	/* Register MPD_CLOCK_T metatable */
+	luaL_newmetatable(L, MPD_CLOCK_T);
+	luaL_register(L, NULL, lreg_clock);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_clock");
+	lua_pushcfunction(L, lmpdclock_new);
+	lua_settable(L, -3);
+}
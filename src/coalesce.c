@@ -0,0 +1,296 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Request coalescing:
+ * Read-only requests issued through the coalesce_* methods share one round
+ * trip while the memo of the connection is fresh. Every caller gets the
+ * same decoded object. The memo lives for a short time, 50 ms unless
+ * coalesce_ttl() sets another, so callers within one tick of the event
+ * loop share a request while state changed by the caller's own commands
+ * is seen on the next tick. It is also flushed by coalesce_flush() and
+ * whenever recv_idle/run_idle report an event.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/entity.h>
+#include <mpd/player.h>
+#include <mpd/response.h>
+#include <mpd/song.h>
+#include <mpd/stats.h>
+#include <mpd/status.h>
+
+#include "globals.h"
+
+/* Lifetime of the memo, seconds */
+#define LMPD_COALESCE_TTL	0.05
+
+/* Pushes the memo table of the connection at index 1, creating it if it
+ * does not exist or has expired. */
+static void lmpdconn_push_memo(lua_State *L)
+{
+	double now, ttl;
+
+	now = lmpd_monotonic();
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "coalesce_ttl");
+	ttl = lua_isnil(L, -1) ? LMPD_COALESCE_TTL : lua_tonumber(L, -1);
+	lua_getfield(L, -2, "coalesce_at");
+	if (now - lua_tonumber(L, -1) > ttl) {
+		lua_pushnil(L);
+		lua_setfield(L, -4, "coalesce");
+	}
+	lua_pop(L, 2);
+
+	lua_getfield(L, -1, "coalesce");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "coalesce");
+		lua_pushnumber(L, now);
+		lua_setfield(L, -3, "coalesce_at");
+	}
+	lua_remove(L, -2);
+}
+
+/* Looks key up in the memo at index memo, returns non-zero and leaves the
+ * value on the stack on a hit. */
+static int lmpdconn_memo_get(lua_State *L, int memo, const char *key)
+{
+	lua_getfield(L, memo, key);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+static int lmpdconn_push_error(lua_State *L, struct mpd_connection *conn)
+{
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, mpd_connection_get_error_message(conn));
+	return 2;
+}
+
+void lmpdconn_coalesce_flush(lua_State *L, int idx)
+{
+	lua_getfenv(L, idx);
+	lua_pushnil(L);
+	lua_setfield(L, -2, "coalesce");
+	lua_pop(L, 1);
+}
+
+static int lmpdconn_coalesce_flush_l(lua_State *L)
+{
+	lmpdconn_check(L, 1);
+
+	lmpdconn_coalesce_flush(L, 1);
+
+	return 0;
+}
+
+/* conn:coalesce_ttl(seconds) sets how long results are shared */
+static int lmpdconn_coalesce_ttl(lua_State *L)
+{
+	double ttl;
+
+	lmpdconn_check(L, 1);
+	ttl = luaL_checknumber(L, 2);
+	luaL_argcheck(L, ttl >= 0, 2, "negative ttl");
+
+	lua_getfenv(L, 1);
+	lua_pushnumber(L, ttl);
+	lua_setfield(L, -2, "coalesce_ttl");
+	lua_pop(L, 1);
+
+	lmpdconn_coalesce_flush(L, 1);
+
+	return 0;
+}
+
+static int lmpdconn_coalesce_status(lua_State *L)
+{
+	struct mpd_connection **conn;
+	struct mpd_status **status;
+
+	conn = lmpdconn_check(L, 1);
+	lua_settop(L, 1);
+
+	assert(*conn != NULL);
+
+	lmpdconn_push_memo(L);
+	if (lmpdconn_memo_get(L, 2, "status"))
+		return 1;
+
+	status = (struct mpd_status **) lua_newuserdata(L, sizeof(struct mpd_status *));
+	luaL_getmetatable(L, MPD_STATUS_T);
+	lua_setmetatable(L, -2);
+
+	*status = mpd_run_status(*conn);
+	if (*status == NULL)
+		return lmpdconn_push_error(L, *conn);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, 2, "status");
+	return 1;
+}
+
+static int lmpdconn_coalesce_current_song(lua_State *L)
+{
+	struct mpd_connection **conn;
+	struct mpd_song **song;
+
+	conn = lmpdconn_check(L, 1);
+	lua_settop(L, 1);
+
+	assert(*conn != NULL);
+
+	lmpdconn_push_memo(L);
+	if (lmpdconn_memo_get(L, 2, "currentsong")) {
+		/* false means there is no current song */
+		if (!lua_toboolean(L, -1))
+			lua_pushnil(L);
+		return 1;
+	}
+
+	song = (struct mpd_song **) lua_newuserdata(L, sizeof(struct mpd_song *));
+	luaL_getmetatable(L, MPD_SONG_T);
+	lua_setmetatable(L, -2);
+
+	*song = mpd_run_current_song(*conn);
+	if (*song == NULL) {
+		if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS)
+			return lmpdconn_push_error(L, *conn);
+		lua_pushboolean(L, 0);
+		lua_setfield(L, 2, "currentsong");
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, 2, "currentsong");
+	return 1;
+}
+
+static int lmpdconn_coalesce_stats(lua_State *L)
+{
+	struct mpd_connection **conn;
+	struct mpd_stats **stats;
+
+	conn = lmpdconn_check(L, 1);
+	lua_settop(L, 1);
+
+	assert(*conn != NULL);
+
+	lmpdconn_push_memo(L);
+	if (lmpdconn_memo_get(L, 2, "stats"))
+		return 1;
+
+	stats = (struct mpd_stats **) lua_newuserdata(L, sizeof(struct mpd_stats *));
+	luaL_getmetatable(L, MPD_STATS_T);
+	lua_setmetatable(L, -2);
+
+	*stats = mpd_run_stats(*conn);
+	if (*stats == NULL)
+		return lmpdconn_push_error(L, *conn);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, 2, "stats");
+	return 1;
+}
+
+static int lmpdconn_coalesce_list_meta(lua_State *L)
+{
+	int i;
+	const char *dir;
+	struct mpd_connection **conn;
+	struct mpd_entity *entity;
+	struct mpd_entity **ud;
+
+	conn = lmpdconn_check(L, 1);
+	dir = luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+
+	assert(*conn != NULL);
+
+	lmpdconn_push_memo(L);
+	lua_pushliteral(L, "lsinfo ");
+	lua_pushvalue(L, 2);
+	lua_concat(L, 2);
+	if (lmpdconn_memo_get(L, 3, lua_tostring(L, 4)))
+		return 1;
+
+	if (!mpd_send_list_meta(*conn, dir))
+		return lmpdconn_push_error(L, *conn);
+
+	lua_newtable(L);
+	for (i = 1; (entity = mpd_recv_entity(*conn)) != NULL; i++) {
+		ud = (struct mpd_entity **) lua_newuserdata(L, sizeof(struct mpd_entity *));
+		luaL_getmetatable(L, MPD_ENTITY_T);
+		lua_setmetatable(L, -2);
+		*ud = entity;
+		lua_rawseti(L, -2, i);
+	}
+
+	if (!mpd_response_finish(*conn))
+		return lmpdconn_push_error(L, *conn);
+
+	lua_pushvalue(L, -1);
+	lua_setfield(L, 3, lua_tostring(L, 4));
+	return 1;
+}
+
+static const luaL_reg lreg_coalesce[] = {
+	{"coalesce_flush",		lmpdconn_coalesce_flush_l},
+	{"coalesce_ttl",		lmpdconn_coalesce_ttl},
+	{"coalesce_status",		lmpdconn_coalesce_status},
+	{"coalesce_current_song",	lmpdconn_coalesce_current_song},
+	{"coalesce_stats",		lmpdconn_coalesce_stats},
+	{"coalesce_list_meta",		lmpdconn_coalesce_list_meta},
+	{NULL,				NULL},
+};
+
+void linit_coalesce(lua_State *L)
+{
+	/* Add coalescing methods to MPD_CONNECTION_T metatable */
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	luaL_register(L, NULL, lreg_coalesce);
+	lua_pop(L, 1);
+}
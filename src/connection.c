@@ -33,8 +33,10 @@
 */
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -48,10 +50,88 @@
 #include <mpd/output.h>
 #include <mpd/pair.h>
 #include <mpd/response.h>
+#include <mpd/send.h>
 #include <mpd/status.h>
+#include <mpd/tag.h>
 
 #include "globals.h"
 
+/* Pushes a new MPD_CONNECTION_T userdata with a fresh environment table,
+ * the caller is responsible for filling in the connection. */
+struct mpd_connection **lmpdconn_newuserdata(lua_State *L, double timeout)
+{
+	struct mpd_connection **conn;
+
+	conn = (struct mpd_connection **) lua_newuserdata(L, sizeof(struct mpd_connection *));
+	*conn = NULL;
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	lua_setmetatable(L, -2);
+
+	/* Per-connection state, e.g. the coalescing memo */
+	lua_newtable(L);
+	lua_pushnumber(L, timeout);
+	lua_setfield(L, -2, "timeout");
+	lua_setfenv(L, -2);
+
+	return conn;
+}
+
+/* Whether the connection at idx is lent to a prefetch thread, see
+ * conn:prefetch() */
+bool lmpdconn_busy(lua_State *L, int idx)
+{
+	bool busy;
+
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "prefetch");
+	busy = !lua_isnil(L, -1);
+	lua_pop(L, 2);
+	return busy;
+}
+
+/* Whether the connection at idx was poisoned */
+bool lmpdconn_poisoned(lua_State *L, int idx)
+{
+	bool poisoned;
+
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "poisoned");
+	poisoned = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	return poisoned;
+}
+
+/* Cuts the connection at idx after an exchange libmpdclient knows nothing
+ * about failed halfway, and marks it in its environment. Its stream is
+ * out of step, so lmpdconn_check() refuses it from then on and only
+ * close() is left. */
+void lmpdconn_poison(lua_State *L, int idx)
+{
+	struct mpd_connection **conn;
+
+	conn = luaL_checkudata(L, idx, MPD_CONNECTION_T);
+	if (*conn != NULL)
+		lmpd_poison(mpd_connection_get_fd(*conn));
+
+	lua_getfenv(L, idx);
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "poisoned");
+	lua_pop(L, 1);
+}
+
+/* Checks that idx is an MPD_CONNECTION_T which is neither busy nor
+ * poisoned */
+struct mpd_connection **lmpdconn_check(lua_State *L, int idx)
+{
+	struct mpd_connection **conn;
+
+	conn = luaL_checkudata(L, idx, MPD_CONNECTION_T);
+	luaL_argcheck(L, !lmpdconn_busy(L, idx), idx, "connection is busy with a prefetch");
+	luaL_argcheck(L, !lmpdconn_poisoned(L, idx), idx,
+			"connection was cut after a failed exchange");
+	return conn;
+}
+
 /* connection.h */
 static int lmpdconn_gc(lua_State *L)
 {
@@ -59,6 +139,9 @@ static int lmpdconn_gc(lua_State *L)
 
 	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
 
+	/* A prefetch reading from the connection lets go of it first */
+	lmpd_prefetch_cancel(L, 1);
+
 	if (*conn != NULL)
 		mpd_connection_free(*conn);
 	*conn = NULL;
@@ -71,12 +154,17 @@ static int lmpdconn_set_timeout(lua_State *L)
 	struct mpd_connection **conn;
 	double timeout;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	timeout = luaL_checknumber(L, 2);
 
 	assert(*conn != NULL);
 
 	mpd_connection_set_timeout(*conn, timeout);
+
+	/* Remembered for code doing its own I/O on the socket */
+	lua_getfenv(L, 1);
+	lua_pushnumber(L, timeout);
+	lua_setfield(L, -2, "timeout");
 	return 0;
 }
 
@@ -84,7 +172,7 @@ static int lmpdconn_get_fd(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -98,7 +186,7 @@ static int lmpdconn_get_error(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -111,7 +199,7 @@ static int lmpdconn_get_error_message(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -124,7 +212,7 @@ static int lmpdconn_get_server_error(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -137,7 +225,7 @@ static int lmpdconn_clear_error(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -150,7 +238,7 @@ static int lmpdconn_get_server_version(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -166,7 +254,7 @@ static int lmpdconn_cmp_server_version(lua_State *L)
 	struct mpd_connection **conn;
 	lua_Integer major, minor, patch;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	major = luaL_checkinteger(L, 2);
 	minor = luaL_checkinteger(L, 3);
 	patch = luaL_checkinteger(L, 4);
@@ -183,7 +271,7 @@ static int lmpdconn_send_allowed_commands(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -196,7 +284,7 @@ static int lmpdconn_send_disallowed_commands(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -210,7 +298,7 @@ static int lmpdconn_recv_command_pair(lua_State *L)
 	struct mpd_pair **pair;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -228,7 +316,7 @@ static int lmpdconn_send_list_url_schemes(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -242,7 +330,7 @@ static int lmpdconn_recv_url_scheme_pair(lua_State *L)
 	struct mpd_pair **pair;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -260,7 +348,7 @@ static int lmpdconn_send_list_tag_types(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -274,7 +362,7 @@ static int lmpdconn_recv_tag_type_pair(lua_State *L)
 	struct mpd_pair **pair;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -288,13 +376,338 @@ static int lmpdconn_recv_tag_type_pair(lua_State *L)
 	return 1;
 }
 
+/* Sends command with up to LMPD_ARGV_MAX arguments, libmpdclient quotes them */
+bool lmpd_send_argv(struct mpd_connection *conn, const char *command,
+		int argc, const char *const *argv)
+{
+	int i;
+	const char *a[LMPD_ARGV_MAX];
+
+	assert(argc <= LMPD_ARGV_MAX);
+
+	for (i = 0; i < LMPD_ARGV_MAX; i++)
+		a[i] = i < argc ? argv[i] : NULL;
+
+	/* The argument list ends at the first NULL */
+	return mpd_send_command(conn, command,
+			a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+			a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15],
+			a[16], a[17], a[18], a[19], a[20], a[21], a[22], a[23],
+			a[24], a[25], a[26], a[27], a[28], a[29], a[30], a[31],
+			a[32], a[33], a[34], a[35], a[36], a[37], a[38], a[39],
+			a[40], a[41], a[42], a[43], a[44], a[45], a[46], a[47],
+			a[48], a[49], a[50], a[51], a[52], a[53], a[54], a[55],
+			a[56], a[57], a[58], a[59], a[60], a[61], a[62], a[63],
+			NULL);
+}
+
+/* Fills argv with the names of the tag types in the table at index idx,
+ * after the sub command, and returns the number of arguments. */
+static int lmpd_check_tag_types(lua_State *L, int idx, const char *sub, const char **argv)
+{
+	int i, n;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = lua_objlen(L, idx);
+	luaL_argcheck(L, n < LMPD_ARGV_MAX, idx, "too many tag types");
+
+	argv[0] = sub;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		argv[i] = mpd_tag_name(luaL_checkinteger(L, -1));
+		lua_pop(L, 1);
+		if (argv[i] == NULL)
+			luaL_argerror(L, idx, "invalid tag type");
+	}
+
+	return n + 1;
+}
+
+static int lmpdconn_send_clear_tag_types(lua_State *L)
+{
+	const char *argv[] = { "clear" };
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", 1, argv));
+
+	return 1;
+}
+
+static int lmpdconn_run_clear_tag_types(lua_State *L)
+{
+	const char *argv[] = { "clear" };
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", 1, argv)
+			&& mpd_response_finish(*conn));
+
+	return 1;
+}
+
+static int lmpdconn_send_all_tag_types(lua_State *L)
+{
+	const char *argv[] = { "all" };
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", 1, argv));
+
+	return 1;
+}
+
+static int lmpdconn_run_all_tag_types(lua_State *L)
+{
+	const char *argv[] = { "all" };
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", 1, argv)
+			&& mpd_response_finish(*conn));
+
+	return 1;
+}
+
+static int lmpdconn_send_enable_tag_types(lua_State *L)
+{
+	int argc;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	argc = lmpd_check_tag_types(L, 2, "enable", argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", argc, argv));
+
+	return 1;
+}
+
+static int lmpdconn_run_enable_tag_types(lua_State *L)
+{
+	int argc;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	argc = lmpd_check_tag_types(L, 2, "enable", argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", argc, argv)
+			&& mpd_response_finish(*conn));
+
+	return 1;
+}
+
+static int lmpdconn_send_disable_tag_types(lua_State *L)
+{
+	int argc;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	argc = lmpd_check_tag_types(L, 2, "disable", argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", argc, argv));
+
+	return 1;
+}
+
+static int lmpdconn_run_disable_tag_types(lua_State *L)
+{
+	int argc;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	argc = lmpd_check_tag_types(L, 2, "disable", argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, "tagtypes", argc, argv)
+			&& mpd_response_finish(*conn));
+
+	return 1;
+}
+
+/* Returns the tag types enabled for this session as an array of MPD_TAG_* */
+static int lmpdconn_run_list_tag_types(lua_State *L)
+{
+	int n;
+	enum mpd_tag_type type;
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+
+	assert(*conn != NULL);
+
+	if (!mpd_send_list_tag_types(*conn)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_newtable(L);
+	n = 0;
+	while ((pair = mpd_recv_tag_type_pair(*conn)) != NULL) {
+		type = mpd_tag_name_iparse(pair->value);
+		mpd_return_pair(*conn, pair);
+		if (type == MPD_TAG_UNKNOWN)
+			continue;
+		lua_pushinteger(L, type);
+		lua_rawseti(L, -2, ++n);
+	}
+
+	if (!mpd_response_finish(*conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* Pushes the names of the tag types enabled for this session, as the
+ * server spells them, or nil and an error message */
+static int lmpdconn_push_tag_type_names(lua_State *L, struct mpd_connection *conn)
+{
+	int n;
+	struct mpd_pair *pair;
+
+	if (!mpd_send_list_tag_types(conn)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(conn));
+		return 2;
+	}
+
+	lua_newtable(L);
+	n = 0;
+	while ((pair = mpd_recv_tag_type_pair(conn)) != NULL) {
+		lua_pushstring(L, pair->value);
+		lua_rawseti(L, -2, ++n);
+		mpd_return_pair(conn, pair);
+	}
+
+	if (!mpd_response_finish(conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* Enables exactly the tag types named in the array at index idx */
+static bool lmpdconn_restore_tag_types(lua_State *L, struct mpd_connection *conn, int idx)
+{
+	int i, n, argc;
+	const char *argv[LMPD_ARGV_MAX];
+	const char *clear[] = { "clear" };
+
+	if (!lmpd_send_argv(conn, "tagtypes", 1, clear) || !mpd_response_finish(conn))
+		return false;
+
+	n = lua_objlen(L, idx);
+	argv[0] = "enable";
+	argc = 1;
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		argv[argc++] = lua_tostring(L, -1);
+		lua_pop(L, 1);
+		if (argc == LMPD_ARGV_MAX || i == n) {
+			if (!lmpd_send_argv(conn, "tagtypes", argc, argv)
+					|| !mpd_response_finish(conn))
+				return false;
+			argc = 1;
+		}
+	}
+
+	return true;
+}
+
+/* Calls fn(conn) with only the given tag types enabled and restores the
+ * previous set of tag types afterwards, even if fn raises an error. When
+ * fn succeeds but the restore fails, nil and an error message are returned
+ * instead of its results. */
+static int lmpdconn_with_tags(lua_State *L)
+{
+	int argc, status, nresults;
+	bool restored;
+	const char *argv[LMPD_ARGV_MAX];
+	const char *clear[] = { "clear" };
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	argc = lmpd_check_tag_types(L, 2, "enable", argv);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	assert(*conn != NULL);
+
+	/* Remember the current set at index 4, names the server reports but
+	 * this build does not know included */
+	if (lmpdconn_push_tag_type_names(L, *conn) != 1)
+		return 2;
+
+	if (!lmpd_send_argv(*conn, "tagtypes", 1, clear)
+			|| !mpd_response_finish(*conn)
+			|| (argc > 1 && (!lmpd_send_argv(*conn, "tagtypes", argc, argv)
+					|| !mpd_response_finish(*conn)))) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		lmpdconn_restore_tag_types(L, *conn, 4);
+		return 2;
+	}
+
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 1);
+	status = lua_pcall(L, 1, LUA_MULTRET, 0);
+	nresults = lua_gettop(L) - 4;
+
+	/* Restore the previous set */
+	if (mpd_connection_get_error(*conn) == MPD_ERROR_SERVER)
+		mpd_connection_clear_error(*conn);
+	restored = lmpdconn_restore_tag_types(L, *conn, 4);
+
+	if (status != 0)
+		return lua_error(L);
+	if (!restored) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "failed to restore the tag types: %s",
+				mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+	return nresults;
+}
+
 /* database.h */
 static int lmpdconn_send_list_all(lua_State *L)
 {
 	const char *dir;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	dir = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -309,7 +722,7 @@ static int lmpdconn_send_list_all_meta(lua_State *L)
 	const char *dir;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	dir = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -324,7 +737,7 @@ static int lmpdconn_send_list_meta(lua_State *L)
 	const char *dir;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	dir = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -339,7 +752,7 @@ static int lmpdconn_send_update(lua_State *L)
 	const char *path;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	path = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -353,7 +766,7 @@ static int lmpdconn_recv_update_id(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -367,7 +780,7 @@ static int lmpdconn_run_update(lua_State *L)
 	const char *path;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	path = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -383,7 +796,7 @@ static int lmpdconn_recv_entity(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_entity **entity;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -402,7 +815,7 @@ static int lmpdconn_send_idle(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -415,7 +828,7 @@ static int lmpdconn_send_noidle(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -427,27 +840,35 @@ static int lmpdconn_send_noidle(lua_State *L)
 static int lmpdconn_recv_idle(lua_State *L)
 {
 	bool disable_timeout;
+	enum mpd_idle idle;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	disable_timeout = lua_toboolean(L, 2);
 
 	assert(*conn != NULL);
 
-	lua_pushinteger(L, mpd_recv_idle(*conn, disable_timeout));
+	idle = mpd_recv_idle(*conn, disable_timeout);
+	if (idle != 0)
+		lmpdconn_coalesce_flush(L, 1);
+	lua_pushinteger(L, idle);
 
 	return 1;
 }
 
 static int lmpdconn_run_idle(lua_State *L)
 {
+	enum mpd_idle idle;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
-	lua_pushinteger(L, mpd_run_idle(*conn));
+	idle = mpd_run_idle(*conn);
+	if (idle != 0)
+		lmpdconn_coalesce_flush(L, 1);
+	lua_pushinteger(L, idle);
 
 	return 1;
 }
@@ -458,7 +879,7 @@ static int lmpdconn_command_list_begin(lua_State *L)
 	bool discrete_ok;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	discrete_ok = lua_toboolean(L, 2);
 
 	assert(*conn != NULL);
@@ -472,7 +893,7 @@ static int lmpdconn_command_list_end(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -487,7 +908,7 @@ static int lmpdconn_send_set_volume(lua_State *L)
 	int change;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	change = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -502,7 +923,7 @@ static int lmpdconn_run_set_volume(lua_State *L)
 	int change;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	change = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -518,7 +939,7 @@ static int lmpdconn_recv_output(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_output **output;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -536,7 +957,7 @@ static int lmpdconn_send_outputs(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -550,7 +971,7 @@ static int lmpdconn_send_enable_output(lua_State *L)
 	int output_id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	output_id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -566,7 +987,7 @@ static int lmpdconn_run_enable_output(lua_State *L)
 	int output_id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	output_id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -582,7 +1003,7 @@ static int lmpdconn_send_disable_output(lua_State *L)
 	int output_id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	output_id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -598,7 +1019,7 @@ static int lmpdconn_run_disable_output(lua_State *L)
 	int output_id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	output_id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -615,7 +1036,7 @@ static int lmpdconn_send_password(lua_State *L)
 	const char *password;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	password = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -630,7 +1051,7 @@ static int lmpdconn_run_password(lua_State *L)
 	const char *password;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	password = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -645,7 +1066,7 @@ static int lmpdconn_send_current_song(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -659,7 +1080,7 @@ static int lmpdconn_run_current_song(lua_State *L)
 	struct mpd_song **song;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -676,7 +1097,7 @@ static int lmpdconn_send_play(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -689,7 +1110,7 @@ static int lmpdconn_run_play(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -703,7 +1124,7 @@ static int lmpdconn_send_play_pos(lua_State *L)
 	int song_pos;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_pos = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -718,7 +1139,7 @@ static int lmpdconn_run_play_pos(lua_State *L)
 	int song_pos;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_pos = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -733,7 +1154,7 @@ static int lmpdconn_send_play_id(lua_State *L)
 	int id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -748,7 +1169,7 @@ static int lmpdconn_run_play_id(lua_State *L)
 	int song_id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -762,7 +1183,7 @@ static int lmpdconn_send_stop(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -775,7 +1196,7 @@ static int lmpdconn_run_stop(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -788,7 +1209,7 @@ static int lmpdconn_send_toggle_pause(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -801,7 +1222,7 @@ static int lmpdconn_run_toggle_pause(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -815,7 +1236,7 @@ static int lmpdconn_send_pause(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -830,7 +1251,7 @@ static int lmpdconn_run_pause(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -844,7 +1265,7 @@ static int lmpdconn_send_next(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -857,7 +1278,7 @@ static int lmpdconn_run_next(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -870,7 +1291,7 @@ static int lmpdconn_send_previous(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -883,7 +1304,7 @@ static int lmpdconn_run_previous(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -897,7 +1318,7 @@ static int lmpdconn_send_seek_pos(lua_State *L)
 	int song_pos, time;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_pos = luaL_checkinteger(L, 2);
 	time = luaL_checkinteger(L, 3);
 
@@ -913,7 +1334,7 @@ static int lmpdconn_run_seek_pos(lua_State *L)
 	int song_pos, time;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_pos = luaL_checkinteger(L, 2);
 	time = luaL_checkinteger(L, 3);
 
@@ -929,7 +1350,7 @@ static int lmpdconn_send_seek_id(lua_State *L)
 	int id, time;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id = luaL_checkinteger(L, 2);
 	time = luaL_checkinteger(L, 3);
 
@@ -945,7 +1366,7 @@ static int lmpdconn_run_seek_id(lua_State *L)
 	int id, time;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id = luaL_checkinteger(L, 2);
 	time = luaL_checkinteger(L, 3);
 
@@ -961,7 +1382,7 @@ static int lmpdconn_send_repeat(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -976,7 +1397,7 @@ static int lmpdconn_run_repeat(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -991,7 +1412,7 @@ static int lmpdconn_send_random(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1006,7 +1427,7 @@ static int lmpdconn_run_random(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1021,7 +1442,7 @@ static int lmpdconn_send_single(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1036,7 +1457,7 @@ static int lmpdconn_run_single(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1051,7 +1472,7 @@ static int lmpdconn_send_consume(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1066,7 +1487,7 @@ static int lmpdconn_run_consume(lua_State *L)
 	int mode;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	mode = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1081,7 +1502,7 @@ static int lmpdconn_send_crossfade(lua_State *L)
 	int seconds;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	seconds = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1096,7 +1517,7 @@ static int lmpdconn_run_crossfade(lua_State *L)
 	int seconds;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	seconds = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1112,7 +1533,7 @@ static int lmpdconn_recv_playlist(lua_State *L)
 	struct mpd_playlist **playlist;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1130,7 +1551,7 @@ static int lmpdconn_send_list_playlist(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1145,7 +1566,7 @@ static int lmpdconn_send_list_playlist_meta(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1160,7 +1581,7 @@ static int lmpdconn_send_playlist_clear(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1175,7 +1596,7 @@ static int lmpdconn_run_playlist_clear(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1190,7 +1611,7 @@ static int lmpdconn_send_playlist_add(lua_State *L)
 	const char *name, *path;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 	path = luaL_checkstring(L, 3);
 
@@ -1206,7 +1627,7 @@ static int lmpdconn_run_playlist_add(lua_State *L)
 	const char *name, *path;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 	path = luaL_checkstring(L, 3);
 
@@ -1223,7 +1644,7 @@ static int lmpdconn_send_playlist_move(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 	from = luaL_checkinteger(L, 3);
 	to = luaL_checkinteger(L, 4);
@@ -1241,7 +1662,7 @@ static int lmpdconn_send_playlist_delete(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 	pos = luaL_checkinteger(L, 3);
 
@@ -1258,7 +1679,7 @@ static int lmpdconn_run_playlist_delete(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 	pos = luaL_checkinteger(L, 3);
 
@@ -1274,7 +1695,7 @@ static int lmpdconn_send_save(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1289,7 +1710,7 @@ static int lmpdconn_run_save(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1304,7 +1725,7 @@ static int lmpdconn_send_load(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1319,7 +1740,7 @@ static int lmpdconn_run_load(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1334,7 +1755,7 @@ static int lmpdconn_send_rename(lua_State *L)
 	const char *from, *to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkstring(L, 2);
 	to = luaL_checkstring(L, 3);
 
@@ -1350,7 +1771,7 @@ static int lmpdconn_run_rename(lua_State *L)
 	const char *from, *to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkstring(L, 2);
 	to = luaL_checkstring(L, 3);
 
@@ -1366,7 +1787,7 @@ static int lmpdconn_send_rm(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1381,7 +1802,7 @@ static int lmpdconn_run_rm(lua_State *L)
 	const char *name;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1396,7 +1817,7 @@ static int lmpdconn_send_list_queue_meta(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1405,12 +1826,95 @@ static int lmpdconn_send_list_queue_meta(lua_State *L)
 	return 1;
 }
 
+/* Sends playlistinfo for the queue positions [start, end) */
+bool lmpd_send_queue_range(struct mpd_connection *conn, unsigned start, unsigned end)
+{
+	char range[32];
+	const char *argv[1];
+
+	snprintf(range, sizeof(range), "%u:%u", start, end);
+	argv[0] = range;
+	return lmpd_send_argv(conn, "playlistinfo", 1, argv);
+}
+
+/* Receives the songs of the current response and pushes them as an array
+ * of MPD_SONG_T, stops at the end of the response (or command list item). */
+void lmpd_push_songs(lua_State *L, struct mpd_connection *conn)
+{
+	int n;
+	struct mpd_song **song;
+
+	lua_newtable(L);
+	for (n = 1; ; n++) {
+		song = (struct mpd_song **) lua_newuserdata(L, sizeof(struct mpd_song *));
+		luaL_getmetatable(L, MPD_SONG_T);
+		lua_setmetatable(L, -2);
+
+		*song = mpd_recv_song(conn);
+		if (*song == NULL) {
+			lua_pop(L, 1);
+			break;
+		}
+		lua_rawseti(L, -2, n);
+	}
+}
+
+static int lmpdconn_send_list_queue_range_meta(lua_State *L)
+{
+	int start, end;
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	start = luaL_checkinteger(L, 2);
+	end = luaL_checkinteger(L, 3);
+
+	luaL_argcheck(L, start >= 0, 2, "negative position");
+	luaL_argcheck(L, end >= start, 3, "end before start");
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_queue_range(*conn, start, end));
+
+	return 1;
+}
+
+/* Returns the songs at the queue positions [start, end) */
+static int lmpdconn_queue_range(lua_State *L)
+{
+	int start, end;
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	start = luaL_checkinteger(L, 2);
+	end = luaL_checkinteger(L, 3);
+
+	luaL_argcheck(L, start >= 0, 2, "negative position");
+	luaL_argcheck(L, end >= start, 3, "end before start");
+	assert(*conn != NULL);
+
+	if (!lmpd_send_queue_range(*conn, start, end)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lmpd_push_songs(L, *conn);
+
+	if (!mpd_response_finish(*conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
 static int lmpdconn_send_get_queue_song_pos(lua_State *L)
 {
 	int pos;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	pos = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1425,7 +1929,7 @@ static int lmpdconn_send_get_queue_song_id(lua_State *L)
 	int id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1440,7 +1944,7 @@ static int lmpdconn_send_queue_changes_meta(lua_State *L)
 	double playlist;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	playlist = luaL_checknumber(L, 2);
 
 	assert(*conn != NULL);
@@ -1455,7 +1959,7 @@ static int lmpdconn_send_queue_changes_brief(lua_State *L)
 	double playlist;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	playlist = luaL_checknumber(L, 2);
 
 	assert(*conn != NULL);
@@ -1471,7 +1975,7 @@ static int lmpdconn_recv_queue_change_brief(lua_State *L)
 	int id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1493,7 +1997,7 @@ static int lmpdconn_send_add(lua_State *L)
 	const char *file;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	file = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1508,7 +2012,7 @@ static int lmpdconn_send_add_id(lua_State *L)
 	const char *file;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	file = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1522,7 +2026,7 @@ static int lmpdconn_recv_song_id(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1536,7 +2040,7 @@ static int lmpdconn_run_add_id(lua_State *L)
 	const char *file;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	file = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1551,7 +2055,7 @@ static int lmpdconn_send_delete(lua_State *L)
 	int song_pos;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	song_pos = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1566,7 +2070,7 @@ static int lmpdconn_send_delete_id(lua_State *L)
 	int id;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id = luaL_checkinteger(L, 2);
 
 	assert(*conn != NULL);
@@ -1580,7 +2084,7 @@ static int lmpdconn_send_shuffle(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1593,7 +2097,7 @@ static int lmpdconn_run_shuffle(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1607,7 +2111,7 @@ static int lmpdconn_send_shuffle_range(lua_State *L)
 	int start, end;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	start = luaL_checkinteger(L, 2);
 	end = luaL_checkinteger(L, 3);
 
@@ -1625,7 +2129,7 @@ static int lmpdconn_run_shuffle_range(lua_State *L)
 	int start, end;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	start = luaL_checkinteger(L, 2);
 	end = luaL_checkinteger(L, 3);
 
@@ -1642,7 +2146,7 @@ static int lmpdconn_send_clear(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1655,7 +2159,7 @@ static int lmpdconn_run_clear(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1669,7 +2173,7 @@ static int lmpdconn_send_move(lua_State *L)
 	int from, to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkinteger(L, 2);
 	to = luaL_checkinteger(L, 3);
 
@@ -1685,7 +2189,7 @@ static int lmpdconn_run_move(lua_State *L)
 	int from, to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkinteger(L, 2);
 	to = luaL_checkinteger(L, 3);
 
@@ -1701,7 +2205,7 @@ static int lmpdconn_send_move_id(lua_State *L)
 	int from, to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkinteger(L, 2);
 	to = luaL_checkinteger(L, 3);
 
@@ -1717,7 +2221,7 @@ static int lmpdconn_run_move_id(lua_State *L)
 	int from, to;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	from = luaL_checkinteger(L, 2);
 	to = luaL_checkinteger(L, 3);
 
@@ -1733,7 +2237,7 @@ static int lmpdconn_send_swap(lua_State *L)
 	int pos1, pos2;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	pos1 = luaL_checkinteger(L, 2);
 	pos2 = luaL_checkinteger(L, 3);
 
@@ -1749,7 +2253,7 @@ static int lmpdconn_run_swap(lua_State *L)
 	int pos1, pos2;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	pos1 = luaL_checkinteger(L, 2);
 	pos2 = luaL_checkinteger(L, 3);
 
@@ -1765,7 +2269,7 @@ static int lmpdconn_send_swap_id(lua_State *L)
 	int id1, id2;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id1 = luaL_checkinteger(L, 2);
 	id2 = luaL_checkinteger(L, 3);
 
@@ -1781,7 +2285,7 @@ static int lmpdconn_run_swap_id(lua_State *L)
 	int id1, id2;
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	id1 = luaL_checkinteger(L, 2);
 	id2 = luaL_checkinteger(L, 3);
 
@@ -1798,7 +2302,7 @@ static int lmpdconn_recv_pair(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_pair **pair;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1827,7 +2331,7 @@ static int lmpdconn_recv_pair_named(lua_State *L)
 	luaL_getmetatable(L, MPD_PAIR_T);
 	lua_setmetatable(L, -2);
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	name = luaL_checkstring(L, 2);
 
 	assert(*conn != NULL);
@@ -1848,7 +2352,7 @@ static int lmpdconn_return_pair(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_pair **pair;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	pair = luaL_checkudata(L, 2, MPD_PAIR_T);
 
 	assert(*conn != NULL);
@@ -1864,7 +2368,7 @@ static int lmpdconn_enqueue_pair(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_pair **pair;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 	pair = luaL_checkudata(L, 2, MPD_PAIR_T);
 
 	assert(*conn != NULL);
@@ -1875,12 +2379,60 @@ static int lmpdconn_enqueue_pair(lua_State *L)
 	return 1;
 }
 
+/* Iterator for pairs() and pairs_named(), the first upvalue is the name
+ * to filter on if any. The pair is returned to libmpdclient before the
+ * strings are handed to Lua, so nothing can leak. */
+static int lmpdconn_pairs_iter(lua_State *L)
+{
+	const char *name;
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+	name = lua_tostring(L, lua_upvalueindex(1));
+
+	assert(*conn != NULL);
+
+	if (name != NULL)
+		pair = mpd_recv_pair_named(*conn, name);
+	else
+		pair = mpd_recv_pair(*conn);
+	if (pair == NULL)
+		return 0;
+
+	lua_pushstring(L, pair->name);
+	lua_pushstring(L, pair->value);
+	mpd_return_pair(*conn, pair);
+	return 2;
+}
+
+static int lmpdconn_pairs(lua_State *L)
+{
+	lmpdconn_check(L, 1);
+
+	lua_pushnil(L);
+	lua_pushcclosure(L, lmpdconn_pairs_iter, 1);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
+static int lmpdconn_pairs_named(lua_State *L)
+{
+	lmpdconn_check(L, 1);
+	luaL_checkstring(L, 2);
+
+	lua_pushvalue(L, 2);
+	lua_pushcclosure(L, lmpdconn_pairs_iter, 1);
+	lua_pushvalue(L, 1);
+	return 2;
+}
+
 /* response.h */
 static int lmpdconn_response_finish(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1893,7 +2445,7 @@ static int lmpdconn_response_next(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1908,7 +2460,7 @@ static int lmpdconn_recv_song(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_song **song;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1923,12 +2475,338 @@ static int lmpdconn_recv_song(lua_State *L)
 	return 1;
 }
 
+#define LMPD_PROJECTION_MAX	64
+
+/* Receives songs as flat tables holding only the fields named in the table
+ * at index 2, either protocol names or tag types. Every other pair is
+ * returned to libmpdclient right away. */
+static int lmpdconn_recv_songs_projected(lua_State *L)
+{
+	int i, n, nfields;
+	bool in_song;
+	const char *fields[LMPD_PROJECTION_MAX];
+	bool seen[LMPD_PROJECTION_MAX];
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	assert(*conn != NULL);
+
+	nfields = lua_objlen(L, 2);
+	luaL_argcheck(L, nfields <= LMPD_PROJECTION_MAX, 2, "too many fields");
+	for (i = 0; i < nfields; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		if (lua_type(L, -1) == LUA_TNUMBER) {
+			fields[i] = mpd_tag_name(lua_tointeger(L, -1));
+			if (fields[i] == NULL)
+				return luaL_argerror(L, 2, "invalid tag type");
+		}
+		else if (lua_type(L, -1) == LUA_TSTRING)
+			/* Kept alive by the fields table */
+			fields[i] = lua_tostring(L, -1);
+		else
+			return luaL_argerror(L, 2, "fields must be strings or tag types");
+		lua_pop(L, 1);
+	}
+
+	lua_settop(L, 2);
+	lua_newtable(L);
+	n = 0;
+	in_song = false;
+	while ((pair = mpd_recv_pair(*conn)) != NULL) {
+		if (strcmp(pair->name, "file") == 0) {
+			if (in_song)
+				lua_pop(L, 1);
+			lua_createtable(L, 0, nfields);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, 3, ++n);
+			memset(seen, 0, sizeof(seen));
+			in_song = true;
+		}
+		else if (strcmp(pair->name, "directory") == 0
+				|| strcmp(pair->name, "playlist") == 0) {
+			if (in_song)
+				lua_pop(L, 1);
+			in_song = false;
+		}
+
+		if (in_song) {
+			for (i = 0; i < nfields; i++) {
+				if (!seen[i] && strcmp(pair->name, fields[i]) == 0) {
+					lua_pushstring(L, pair->value);
+					lua_setfield(L, -2, fields[i]);
+					seen[i] = true;
+					break;
+				}
+			}
+		}
+		mpd_return_pair(*conn, pair);
+	}
+	if (in_song)
+		lua_pop(L, 1);
+
+	if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* search.h */
+static const char *lmpd_check_tag_name(lua_State *L, int idx)
+{
+	const char *name;
+
+	name = mpd_tag_name(luaL_checkinteger(L, idx));
+	if (name == NULL)
+		luaL_argerror(L, idx, "invalid tag type");
+	return name;
+}
+
+/* count [filter] [group tag]: without group returns {songs=, playtime=},
+ * with group a table mapping each group value to such a table. */
+static int lmpdconn_run_count(lua_State *L)
+{
+	int argc;
+	bool in_row;
+	const char *filter, *group;
+	const char *argv[3];
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+	filter = luaL_optstring(L, 2, NULL);
+	group = lua_isnoneornil(L, 3) ? NULL : lmpd_check_tag_name(L, 3);
+	lua_settop(L, 3);
+
+	assert(*conn != NULL);
+
+	argc = 0;
+	if (filter != NULL)
+		argv[argc++] = filter;
+	if (group != NULL) {
+		argv[argc++] = "group";
+		argv[argc++] = group;
+	}
+
+	if (!lmpd_send_argv(*conn, "count", argc, argv)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_newtable(L);
+	in_row = (group == NULL);
+	if (in_row)
+		lua_pushvalue(L, -1);
+	while ((pair = mpd_recv_pair(*conn)) != NULL) {
+		if (group != NULL && strcasecmp(pair->name, group) == 0) {
+			if (in_row)
+				lua_pop(L, 1);
+			lua_createtable(L, 0, 2);
+			lua_pushstring(L, pair->value);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 4);
+			in_row = true;
+		}
+		else if (in_row && strcmp(pair->name, "songs") == 0) {
+			lua_pushnumber(L, strtod(pair->value, NULL));
+			lua_setfield(L, -2, "songs");
+		}
+		else if (in_row && strcmp(pair->name, "playtime") == 0) {
+			lua_pushnumber(L, strtod(pair->value, NULL));
+			lua_setfield(L, -2, "playtime");
+		}
+		mpd_return_pair(*conn, pair);
+	}
+	if (in_row)
+		lua_pop(L, 1);
+
+	if (!mpd_response_finish(*conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* list tag [filter] group group_tag: returns a table mapping each group
+ * value to the array of tag values in that group. */
+static int lmpdconn_run_list_grouped(lua_State *L)
+{
+	int argc, n;
+	const char *tag, *group, *filter;
+	const char *argv[4];
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+	tag = lmpd_check_tag_name(L, 2);
+	group = lmpd_check_tag_name(L, 3);
+	filter = luaL_optstring(L, 4, NULL);
+	lua_settop(L, 4);
+
+	assert(*conn != NULL);
+
+	argc = 0;
+	argv[argc++] = tag;
+	if (filter != NULL)
+		argv[argc++] = filter;
+	argv[argc++] = "group";
+	argv[argc++] = group;
+
+	if (!lmpd_send_argv(*conn, "list", argc, argv)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_newtable(L);
+	n = -1;
+	while ((pair = mpd_recv_pair(*conn)) != NULL) {
+		if (strcasecmp(pair->name, group) == 0) {
+			if (n >= 0)
+				lua_pop(L, 1);
+			lua_pushstring(L, pair->value);
+			lua_rawget(L, 5);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushstring(L, pair->value);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, 5);
+			}
+			n = lua_objlen(L, -1);
+		}
+		else if (n >= 0 && strcasecmp(pair->name, tag) == 0) {
+			lua_pushstring(L, pair->value);
+			lua_rawseti(L, -2, ++n);
+		}
+		mpd_return_pair(*conn, pair);
+	}
+	if (n >= 0)
+		lua_pop(L, 1);
+
+	if (!mpd_response_finish(*conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* list tag [filter]: returns the distinct values as a set */
+static int lmpdconn_run_list_set(lua_State *L)
+{
+	int argc;
+	const char *tag, *filter;
+	const char *argv[2];
+	struct mpd_connection **conn;
+	struct mpd_pair *pair;
+
+	conn = lmpdconn_check(L, 1);
+	tag = lmpd_check_tag_name(L, 2);
+	filter = luaL_optstring(L, 3, NULL);
+
+	assert(*conn != NULL);
+
+	argc = 0;
+	argv[argc++] = tag;
+	if (filter != NULL)
+		argv[argc++] = filter;
+
+	if (!lmpd_send_argv(*conn, "list", argc, argv)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_newtable(L);
+	while ((pair = mpd_recv_pair_named(*conn, tag)) != NULL) {
+		lua_pushstring(L, pair->value);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		mpd_return_pair(*conn, pair);
+	}
+
+	if (!mpd_response_finish(*conn)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	return 1;
+}
+
+/* send.h */
+/* Collects the arguments of send_command() and run_command(), returns argc */
+static int lmpd_check_argv(lua_State *L, const char **argv)
+{
+	int i, argc;
+
+	argc = lua_gettop(L) - 2;
+	if (argc > LMPD_ARGV_MAX)
+		return luaL_error(L, "too many arguments, at most %d are supported", LMPD_ARGV_MAX);
+
+	for (i = 0; i < argc; i++)
+		argv[i] = luaL_checkstring(L, i + 3);
+
+	return argc;
+}
+
+static int lmpdconn_send_command(lua_State *L)
+{
+	int argc;
+	const char *name;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	name = luaL_checkstring(L, 2);
+	argc = lmpd_check_argv(L, argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, name, argc, argv));
+
+	return 1;
+}
+
+static int lmpdconn_run_command(lua_State *L)
+{
+	int argc;
+	const char *name;
+	const char *argv[LMPD_ARGV_MAX];
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, 1);
+	name = luaL_checkstring(L, 2);
+	argc = lmpd_check_argv(L, argv);
+
+	assert(*conn != NULL);
+
+	lua_pushboolean(L, lmpd_send_argv(*conn, name, argc, argv)
+			&& mpd_response_finish(*conn));
+
+	return 1;
+}
+
 /* stats.h */
 static int lmpdconn_send_stats(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1942,7 +2820,7 @@ static int lmpdconn_recv_stats(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_stats **stats;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1962,7 +2840,7 @@ static int lmpdconn_run_stats(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_stats **stats;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1982,7 +2860,7 @@ static int lmpdconn_send_status(lua_State *L)
 {
 	struct mpd_connection **conn;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -1996,7 +2874,7 @@ static int lmpdconn_recv_status(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_status **status;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -2020,7 +2898,7 @@ static int lmpdconn_run_status(lua_State *L)
 	struct mpd_connection **conn;
 	struct mpd_status **status;
 
-	conn = luaL_checkudata(L, 1, MPD_CONNECTION_T);
+	conn = lmpdconn_check(L, 1);
 
 	assert(*conn != NULL);
 
@@ -2060,6 +2938,16 @@ static const luaL_reg lreg_connection[] = {
 	{"recv_url_scheme_pair",	lmpdconn_recv_url_scheme_pair},
 	{"send_list_tag_types",		lmpdconn_send_list_tag_types},
 	{"recv_tag_type_pair",		lmpdconn_recv_tag_type_pair},
+	{"run_list_tag_types",		lmpdconn_run_list_tag_types},
+	{"send_clear_tag_types",	lmpdconn_send_clear_tag_types},
+	{"run_clear_tag_types",		lmpdconn_run_clear_tag_types},
+	{"send_all_tag_types",		lmpdconn_send_all_tag_types},
+	{"run_all_tag_types",		lmpdconn_run_all_tag_types},
+	{"send_enable_tag_types",	lmpdconn_send_enable_tag_types},
+	{"run_enable_tag_types",	lmpdconn_run_enable_tag_types},
+	{"send_disable_tag_types",	lmpdconn_send_disable_tag_types},
+	{"run_disable_tag_types",	lmpdconn_run_disable_tag_types},
+	{"with_tags",			lmpdconn_with_tags},
 	/* database.h */
 	{"send_list_all",		lmpdconn_send_list_all},
 	{"send_list_all_meta",		lmpdconn_send_list_all_meta},
@@ -2144,6 +3032,8 @@ static const luaL_reg lreg_connection[] = {
 	{"run_rm",			lmpdconn_run_rm},
 	/* queue.h */
 	{"send_list_queue_meta",	lmpdconn_send_list_queue_meta},
+	{"send_list_queue_range_meta",	lmpdconn_send_list_queue_range_meta},
+	{"queue_range",			lmpdconn_queue_range},
 	{"send_get_queue_song_pos",	lmpdconn_send_get_queue_song_pos},
 	{"send_get_queue_song_id",	lmpdconn_send_get_queue_song_id},
 	{"send_queue_changes_meta",	lmpdconn_send_queue_changes_meta},
@@ -2174,11 +3064,21 @@ static const luaL_reg lreg_connection[] = {
 	{"recv_pair_named",		lmpdconn_recv_pair_named},
 	{"return_pair",			lmpdconn_return_pair},
 	{"enqueue_pair",		lmpdconn_enqueue_pair},
+	{"pairs",			lmpdconn_pairs},
+	{"pairs_named",			lmpdconn_pairs_named},
 	/* response.h */
 	{"response_finish",		lmpdconn_response_finish},
 	{"reponse_next",		lmpdconn_response_next},
+	/* search.h */
+	{"run_count",			lmpdconn_run_count},
+	{"run_list_grouped",		lmpdconn_run_list_grouped},
+	{"run_list_set",		lmpdconn_run_list_set},
+	/* send.h */
+	{"send_command",		lmpdconn_send_command},
+	{"run_command",			lmpdconn_run_command},
 	/* song.h */
 	{"recv_song",			lmpdconn_recv_song},
+	{"recv_songs_projected",	lmpdconn_recv_songs_projected},
 	/* stats.h */
 	{"send_stats",			lmpdconn_send_stats},
 	{"recv_stats",			lmpdconn_recv_stats},
@@ -0,0 +1,214 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Parallel crawl:
+ * Walks the database below a directory with lsinfo requests spread over
+ * several connections. Directories found in the responses are added to a
+ * shared work queue and handed to whichever connection becomes free, so
+ * the round trips of the connections overlap.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/directory.h>
+#include <mpd/entity.h>
+#include <mpd/response.h>
+
+#include "globals.h"
+
+#define LMPD_CRAWL_MAX	64
+
+/* Finishes the responses that are still in flight */
+static void lmpdcrawl_abort(struct mpd_connection **conns, const bool *busy, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (busy[i])
+			mpd_response_finish(conns[i]);
+	}
+}
+
+/* mpdclient.crawl(conns, root[, fn]) lists every entity below root. With fn
+ * each entity is passed to fn as it arrives, otherwise all entities are
+ * returned in one array. */
+static int lmpdcrawl(lua_State *L)
+{
+	int i, n, nbusy, head, tail, count, ret;
+	bool has_fn;
+	const char *path, *errmsg;
+	bool busy[LMPD_CRAWL_MAX];
+	struct mpd_connection *conns[LMPD_CRAWL_MAX];
+	struct pollfd pfds[LMPD_CRAWL_MAX];
+	int which[LMPD_CRAWL_MAX];
+	struct mpd_connection **conn;
+	struct mpd_entity *entity;
+	struct mpd_entity **ud;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checkstring(L, 2);
+	has_fn = !lua_isnoneornil(L, 3);
+	if (has_fn)
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	n = lua_objlen(L, 1);
+	luaL_argcheck(L, n > 0, 1, "no connections");
+	luaL_argcheck(L, n <= LMPD_CRAWL_MAX, 1, "too many connections");
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		conn = luaL_checkudata(L, -1, MPD_CONNECTION_T);
+		luaL_argcheck(L, !lmpdconn_busy(L, -1), 1, "connection is busy with a prefetch");
+		luaL_argcheck(L, !lmpdconn_poisoned(L, -1), 1,
+				"connection was cut after a failed exchange");
+		assert(*conn != NULL);
+		conns[i] = *conn;
+		busy[i] = false;
+		lua_pop(L, 1);
+	}
+
+	/* Work queue at 4, results at 5 */
+	lua_newtable(L);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, 4, 1);
+	head = 1;
+	tail = 1;
+	lua_newtable(L);
+	count = 0;
+	nbusy = 0;
+	errmsg = NULL;
+
+	while (head <= tail || nbusy > 0) {
+		/* Hand out work to free connections */
+		for (i = 0; i < n && head <= tail; i++) {
+			if (busy[i])
+				continue;
+			lua_rawgeti(L, 4, head);
+			path = lua_tostring(L, -1);
+			if (!mpd_send_list_meta(conns[i], path)) {
+				lua_pop(L, 1);
+				errmsg = mpd_connection_get_error_message(conns[i]);
+				goto fail;
+			}
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			lua_rawseti(L, 4, head++);
+			busy[i] = true;
+			nbusy++;
+		}
+
+		/* Wait for any response */
+		nbusy = 0;
+		for (i = 0; i < n; i++) {
+			if (!busy[i])
+				continue;
+			pfds[nbusy].fd = mpd_connection_get_fd(conns[i]);
+			pfds[nbusy].events = POLLIN;
+			pfds[nbusy].revents = 0;
+			which[nbusy++] = i;
+		}
+		ret = poll(pfds, nbusy, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			errmsg = "poll failed";
+			goto fail;
+		}
+
+		for (ret = 0; ret < nbusy; ret++) {
+			if (pfds[ret].revents == 0)
+				continue;
+			i = which[ret];
+
+			while ((entity = mpd_recv_entity(conns[i])) != NULL) {
+				if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_DIRECTORY) {
+					lua_pushstring(L, mpd_directory_get_path(mpd_entity_get_directory(entity)));
+					lua_rawseti(L, 4, ++tail);
+				}
+
+				if (has_fn)
+					lua_pushvalue(L, 3);
+				ud = (struct mpd_entity **) lua_newuserdata(L, sizeof(struct mpd_entity *));
+				*ud = entity;
+				luaL_getmetatable(L, MPD_ENTITY_T);
+				lua_setmetatable(L, -2);
+
+				if (!has_fn)
+					lua_rawseti(L, 5, ++count);
+				else if (lua_pcall(L, 1, 0, 0) != 0) {
+					mpd_response_finish(conns[i]);
+					busy[i] = false;
+					lmpdcrawl_abort(conns, busy, n);
+					return lua_error(L);
+				}
+			}
+
+			busy[i] = false;
+			if (!mpd_response_finish(conns[i])) {
+				errmsg = mpd_connection_get_error_message(conns[i]);
+				goto fail;
+			}
+		}
+
+		nbusy = 0;
+		for (i = 0; i < n; i++) {
+			if (busy[i])
+				nbusy++;
+		}
+	}
+
+	if (has_fn)
+		return 0;
+	return 1;
+
+fail:
+	lmpdcrawl_abort(conns, busy, n);
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+}
+
+void linit_crawl(lua_State *L)
+{
+	lua_pushliteral(L, "crawl");
+	lua_pushcfunction(L, lmpdcrawl);
+	lua_settable(L, -3);
+}
@@ -0,0 +1,538 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Directory cache:
+ * Keeps the directories browsed so far as a tree of path components with
+ * the last modification times reported by the server. Lookups and path
+ * completion are served from the tree without a round trip. refresh()
+ * lists the root again and descends only into cached directories whose
+ * modification time changed in their parent's listing.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/database.h>
+#include <mpd/directory.h>
+#include <mpd/entity.h>
+#include <mpd/playlist.h>
+#include <mpd/response.h>
+#include <mpd/song.h>
+
+#include "globals.h"
+
+struct dc_node {
+	/* last path component and full path, name points into path */
+	char *path;
+	const char *name;
+	time_t mtime;
+	enum mpd_entity_type type;
+	/* children have been fetched */
+	bool listed;
+	/* set while merging a listing */
+	bool seen;
+	bool fresh;
+	bool stale;
+	/* sorted by name */
+	struct dc_node **children;
+	unsigned nchildren;
+};
+
+struct lmpd_dircache {
+	struct dc_node *root;
+};
+
+static struct dc_node *dc_node_new(const char *path, enum mpd_entity_type type, time_t mtime)
+{
+	const char *slash;
+	struct dc_node *node;
+
+	node = calloc(1, sizeof(struct dc_node));
+	if (node == NULL)
+		return NULL;
+
+	node->path = strdup(path);
+	if (node->path == NULL) {
+		free(node);
+		return NULL;
+	}
+	slash = strrchr(node->path, '/');
+	node->name = slash != NULL ? slash + 1 : node->path;
+	node->type = type;
+	node->mtime = mtime;
+
+	return node;
+}
+
+static void dc_node_free(struct dc_node *node)
+{
+	unsigned i;
+
+	for (i = 0; i < node->nchildren; i++)
+		dc_node_free(node->children[i]);
+	free(node->children);
+	free(node->path);
+	free(node);
+}
+
+static int dc_node_cmp(const void *a, const void *b)
+{
+	const struct dc_node *const *x = a;
+	const struct dc_node *const *y = b;
+
+	return strcmp((*x)->name, (*y)->name);
+}
+
+/* Returns the index of the first child whose name is not less than name
+ * compared on the first len bytes. */
+static unsigned dc_lower_bound(const struct dc_node *dir, const char *name, size_t len)
+{
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = dir->nchildren;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (strncmp(dir->children[mid]->name, name, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct dc_node *dc_child(const struct dc_node *dir, const char *name, size_t len)
+{
+	unsigned i;
+
+	i = dc_lower_bound(dir, name, len);
+	if (i < dir->nchildren
+			&& strncmp(dir->children[i]->name, name, len) == 0
+			&& dir->children[i]->name[len] == '\0')
+		return dir->children[i];
+	return NULL;
+}
+
+/* Walks the tree along path, returns NULL if a component is not cached */
+static struct dc_node *dc_lookup(struct dc_node *root, const char *path)
+{
+	const char *slash;
+	struct dc_node *node;
+
+	node = root;
+	while (node != NULL && *path != '\0') {
+		slash = strchr(path, '/');
+		if (slash == NULL) {
+			node = dc_child(node, path, strlen(path));
+			break;
+		}
+		node = dc_child(node, path, slash - path);
+		path = slash + 1;
+	}
+	return node;
+}
+
+/* Lists dir on the server and merges the result into its children. Child
+ * directories which were listed before and whose modification time changed
+ * are marked stale. Nothing changes unless the whole listing arrives. */
+static bool dc_fetch(struct mpd_connection *conn, struct dc_node *dir)
+{
+	unsigned i, n, size;
+	const char *path;
+	time_t mtime;
+	enum mpd_entity_type type;
+	struct dc_node *child, *old;
+	time_t *mtimes, *tmt;
+	struct dc_node **children, **tmp;
+	struct mpd_entity *entity;
+
+	if (!mpd_send_list_meta(conn, dir->path))
+		return false;
+
+	for (i = 0; i < dir->nchildren; i++)
+		dir->children[i]->seen = false;
+
+	children = NULL;
+	mtimes = NULL;
+	n = size = 0;
+	while ((entity = mpd_recv_entity(conn)) != NULL) {
+		type = mpd_entity_get_type(entity);
+		switch (type) {
+		case MPD_ENTITY_TYPE_DIRECTORY:
+			path = mpd_directory_get_path(mpd_entity_get_directory(entity));
+			mtime = mpd_directory_get_last_modified(mpd_entity_get_directory(entity));
+			break;
+		case MPD_ENTITY_TYPE_SONG:
+			path = mpd_song_get_uri(mpd_entity_get_song(entity));
+			mtime = mpd_song_get_last_modified(mpd_entity_get_song(entity));
+			break;
+		case MPD_ENTITY_TYPE_PLAYLIST:
+			path = mpd_playlist_get_path(mpd_entity_get_playlist(entity));
+			mtime = mpd_playlist_get_last_modified(mpd_entity_get_playlist(entity));
+			break;
+		default:
+			mpd_entity_free(entity);
+			continue;
+		}
+
+		path = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+		old = dc_child(dir, path, strlen(path));
+		if (old != NULL && old->type == type && !old->seen) {
+			/* Its new mtime is applied once the listing is complete */
+			child = old;
+			child->seen = true;
+		}
+		else {
+			child = dc_node_new(type == MPD_ENTITY_TYPE_SONG
+					? mpd_song_get_uri(mpd_entity_get_song(entity))
+					: type == MPD_ENTITY_TYPE_DIRECTORY
+					? mpd_directory_get_path(mpd_entity_get_directory(entity))
+					: mpd_playlist_get_path(mpd_entity_get_playlist(entity)),
+					type, mtime);
+			if (child != NULL)
+				child->fresh = true;
+		}
+		mpd_entity_free(entity);
+
+		if (child == NULL)
+			goto oom;
+		if (n == size) {
+			size = size * 2 + 16;
+			tmp = realloc(children, size * sizeof(struct dc_node *));
+			if (tmp != NULL)
+				children = tmp;
+			tmt = tmp != NULL ? realloc(mtimes, size * sizeof(time_t)) : NULL;
+			if (tmt == NULL) {
+				if (child->fresh)
+					dc_node_free(child);
+				goto oom;
+			}
+			mtimes = tmt;
+		}
+		mtimes[n] = mtime;
+		children[n++] = child;
+	}
+
+	if (!mpd_response_finish(conn))
+		goto fail;
+
+	/* Children which disappeared go away with their subtrees */
+	for (i = 0; i < dir->nchildren; i++) {
+		if (!dir->children[i]->seen)
+			dc_node_free(dir->children[i]);
+	}
+	free(dir->children);
+
+	for (i = 0; i < n; i++) {
+		child = children[i];
+		if (!child->fresh) {
+			child->stale = child->listed && child->mtime != mtimes[i];
+			child->mtime = mtimes[i];
+		}
+		child->fresh = false;
+	}
+	free(mtimes);
+	qsort(children, n, sizeof(struct dc_node *), dc_node_cmp);
+	dir->children = children;
+	dir->nchildren = n;
+	dir->listed = true;
+	return true;
+
+oom:
+	mpd_response_finish(conn);
+fail:
+	for (i = 0; i < n; i++) {
+		if (children[i]->fresh)
+			dc_node_free(children[i]);
+	}
+	free(children);
+	free(mtimes);
+	return false;
+}
+
+/* Refreshes dir and, recursively, its stale children. Counts the listings
+ * done in *count. */
+static bool dc_refresh(struct mpd_connection *conn, struct dc_node *dir, unsigned *count)
+{
+	unsigned i;
+
+	if (!dc_fetch(conn, dir))
+		return false;
+	(*count)++;
+
+	for (i = 0; i < dir->nchildren; i++) {
+		if (!dir->children[i]->stale)
+			continue;
+		dir->children[i]->stale = false;
+		if (!dc_refresh(conn, dir->children[i], count))
+			return false;
+	}
+	return true;
+}
+
+static void dc_push_node(lua_State *L, const struct dc_node *node)
+{
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, node->type);
+	lua_setfield(L, -2, "type");
+	lua_pushstring(L, node->path);
+	lua_setfield(L, -2, "path");
+	lua_pushstring(L, node->name);
+	lua_setfield(L, -2, "name");
+	lua_pushnumber(L, node->mtime);
+	lua_setfield(L, -2, "last_modified");
+	lua_pushboolean(L, node->listed);
+	lua_setfield(L, -2, "listed");
+}
+
+static int lmpddircache_new(lua_State *L)
+{
+	struct lmpd_dircache *cache;
+
+	cache = (struct lmpd_dircache *) lua_newuserdata(L, sizeof(struct lmpd_dircache));
+	cache->root = NULL;
+	luaL_getmetatable(L, MPD_DIRCACHE_T);
+	lua_setmetatable(L, -2);
+
+	cache->root = dc_node_new("", MPD_ENTITY_TYPE_DIRECTORY, 0);
+	if (cache->root == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+
+	return 1;
+}
+
+static int lmpddircache_gc(lua_State *L)
+{
+	struct lmpd_dircache *cache;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+
+	if (cache->root != NULL)
+		dc_node_free(cache->root);
+	cache->root = NULL;
+
+	return 0;
+}
+
+/* cache:list(conn, path) returns the children of path, fetching them from
+ * the server the first time. */
+static int lmpddircache_list(lua_State *L)
+{
+	unsigned i;
+	const char *path;
+	struct lmpd_dircache *cache;
+	struct mpd_connection **conn;
+	struct dc_node *dir;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+	conn = lmpdconn_check(L, 2);
+	path = luaL_optstring(L, 3, "");
+
+	assert(cache->root != NULL);
+	assert(*conn != NULL);
+
+	dir = dc_lookup(cache->root, path);
+	if (dir == NULL || dir->type != MPD_ENTITY_TYPE_DIRECTORY) {
+		/* Unknown so far, fetch the parents first */
+		lua_pushnil(L);
+		lua_pushfstring(L, "`%s' is not a cached directory", path);
+		return 2;
+	}
+
+	if (!dir->listed && !dc_fetch(*conn, dir)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_createtable(L, dir->nchildren, 0);
+	for (i = 0; i < dir->nchildren; i++) {
+		dc_push_node(L, dir->children[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+/* cache:lookup(path) returns the cached node at path or nil */
+static int lmpddircache_lookup(lua_State *L)
+{
+	const char *path;
+	struct lmpd_dircache *cache;
+	struct dc_node *node;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+	path = luaL_checkstring(L, 2);
+
+	assert(cache->root != NULL);
+
+	node = dc_lookup(cache->root, path);
+	if (node == NULL)
+		lua_pushnil(L);
+	else
+		dc_push_node(L, node);
+	return 1;
+}
+
+/* cache:complete(prefix[, limit]) returns the cached paths starting with
+ * prefix, among the children of the directory named by prefix. */
+static int lmpddircache_complete(lua_State *L)
+{
+	int n, limit;
+	unsigned i;
+	size_t len;
+	const char *prefix, *slash, *partial;
+	struct lmpd_dircache *cache;
+	struct dc_node *dir;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+	prefix = luaL_checkstring(L, 2);
+	limit = luaL_optinteger(L, 3, 0);
+
+	assert(cache->root != NULL);
+
+	slash = strrchr(prefix, '/');
+	if (slash == NULL) {
+		dir = cache->root;
+		partial = prefix;
+	}
+	else {
+		lua_pushlstring(L, prefix, slash - prefix);
+		dir = dc_lookup(cache->root, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		partial = slash + 1;
+	}
+
+	lua_newtable(L);
+	if (dir == NULL)
+		return 1;
+
+	len = strlen(partial);
+	n = 0;
+	for (i = dc_lower_bound(dir, partial, len); i < dir->nchildren; i++) {
+		if (strncmp(dir->children[i]->name, partial, len) != 0)
+			break;
+		if (limit > 0 && n >= limit)
+			break;
+		lua_pushstring(L, dir->children[i]->path);
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+/* cache:refresh(conn) to be called on MPD_IDLE_DATABASE, returns the number
+ * of directories listed again. */
+static int lmpddircache_refresh(lua_State *L)
+{
+	unsigned count;
+	struct lmpd_dircache *cache;
+	struct mpd_connection **conn;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+	conn = lmpdconn_check(L, 2);
+
+	assert(cache->root != NULL);
+	assert(*conn != NULL);
+
+	count = 0;
+	if (cache->root->listed && !dc_refresh(*conn, cache->root, &count)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/* cache:invalidate(path) forgets the children of path */
+static int lmpddircache_invalidate(lua_State *L)
+{
+	unsigned i;
+	const char *path;
+	struct lmpd_dircache *cache;
+	struct dc_node *node;
+
+	cache = luaL_checkudata(L, 1, MPD_DIRCACHE_T);
+	path = luaL_optstring(L, 2, "");
+
+	assert(cache->root != NULL);
+
+	node = dc_lookup(cache->root, path);
+	if (node != NULL) {
+		for (i = 0; i < node->nchildren; i++)
+			dc_node_free(node->children[i]);
+		free(node->children);
+		node->children = NULL;
+		node->nchildren = 0;
+		node->listed = false;
+	}
+	return 0;
+}
+
+static const luaL_reg lreg_dircache[] = {
+	{"__gc",	lmpddircache_gc},
+	{"list",	lmpddircache_list},
+	{"lookup",	lmpddircache_lookup},
+	{"complete",	lmpddircache_complete},
+	{"refresh",	lmpddircache_refresh},
+	{"invalidate",	lmpddircache_invalidate},
+	{NULL,		NULL},
+};
+
+void linit_dircache(lua_State *L)
+{
+	/* Register MPD_DIRCACHE_T metatable */
+	luaL_newmetatable(L, MPD_DIRCACHE_T);
+	luaL_register(L, NULL, lreg_dircache);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2); /* push the metatable */
+	lua_settable(L, -3); /* metatable.__index = metatable */
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_dir_cache");
+	lua_pushcfunction(L, lmpddircache_new);
+	lua_settable(L, -3);
+}
@@ -0,0 +1,300 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Dual connection:
+ * One socket is kept in idle mode permanently, the other one is used for
+ * commands. Connection methods are forwarded to the command socket so a
+ * dual connection can be used wherever a connection is expected, without
+ * paying for the noidle/idle toggle around every command.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/idle.h>
+#include <mpd/password.h>
+
+#include "globals.h"
+
+struct lmpd_dual {
+	struct mpd_connection **cmd;
+	struct mpd_connection **idle;
+	/* events received while leaving idle mode, reported by recv_idle */
+	enum mpd_idle pending;
+};
+
+static int lmpddual_new(lua_State *L)
+{
+	const char *host;
+	int port;
+	double timeout;
+	struct lmpd_dual *dual;
+
+	host = luaL_checkstring(L, 1);
+	port = luaL_checkinteger(L, 2);
+	timeout = luaL_checknumber(L, 3);
+
+	dual = (struct lmpd_dual *) lua_newuserdata(L, sizeof(struct lmpd_dual));
+	dual->cmd = NULL;
+	dual->idle = NULL;
+	dual->pending = 0;
+	luaL_getmetatable(L, MPD_DUAL_T);
+	lua_setmetatable(L, -2);
+
+	/* The environment table keeps both connections alive */
+	lua_newtable(L);
+
+	dual->cmd = lmpdconn_newuserdata(L, timeout);
+	*dual->cmd = mpd_connection_new(host, port, timeout);
+	lua_setfield(L, -2, "cmd");
+
+	dual->idle = lmpdconn_newuserdata(L, timeout);
+	*dual->idle = mpd_connection_new(host, port, timeout);
+	lua_setfield(L, -2, "idle");
+
+	lua_setfenv(L, -2);
+
+	if (*dual->cmd == NULL || *dual->idle == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	if (mpd_connection_get_error(*dual->cmd) != MPD_ERROR_SUCCESS) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*dual->cmd));
+		return 2;
+	}
+	if (mpd_connection_get_error(*dual->idle) != MPD_ERROR_SUCCESS
+			|| !mpd_send_idle(*dual->idle)) {
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*dual->idle));
+		return 2;
+	}
+
+	return 1;
+}
+
+static int lmpddual_close(lua_State *L)
+{
+	struct lmpd_dual *dual;
+
+	dual = luaL_checkudata(L, 1, MPD_DUAL_T);
+
+	if (dual->cmd != NULL && *dual->cmd != NULL) {
+		mpd_connection_free(*dual->cmd);
+		*dual->cmd = NULL;
+	}
+	if (dual->idle != NULL && *dual->idle != NULL) {
+		mpd_connection_free(*dual->idle);
+		*dual->idle = NULL;
+	}
+
+	return 0;
+}
+
+static int lmpddual_command_connection(lua_State *L)
+{
+	luaL_checkudata(L, 1, MPD_DUAL_T);
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "cmd");
+	return 1;
+}
+
+static int lmpddual_idle_connection(lua_State *L)
+{
+	luaL_checkudata(L, 1, MPD_DUAL_T);
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "idle");
+	return 1;
+}
+
+static int lmpddual_get_idle_fd(lua_State *L)
+{
+	struct lmpd_dual *dual;
+
+	dual = luaL_checkudata(L, 1, MPD_DUAL_T);
+
+	assert(*dual->idle != NULL);
+
+	lua_pushinteger(L, mpd_connection_get_fd(*dual->idle));
+	return 1;
+}
+
+static int lmpddual_recv_idle(lua_State *L)
+{
+	bool disable_timeout, received;
+	enum mpd_idle idle;
+	struct lmpd_dual *dual;
+
+	dual = luaL_checkudata(L, 1, MPD_DUAL_T);
+	disable_timeout = lua_toboolean(L, 2);
+
+	assert(*dual->idle != NULL);
+
+	if (dual->pending != 0) {
+		idle = dual->pending;
+		dual->pending = 0;
+		received = false;
+	}
+	else {
+		received = true;
+		idle = mpd_recv_idle(*dual->idle, disable_timeout);
+		if (idle == 0) {
+			/* Push nil and error message */
+			lua_pushnil(L);
+			lua_pushstring(L, mpd_connection_get_error_message(*dual->idle));
+			return 2;
+		}
+	}
+
+	/* Results memoised on the command socket are stale now */
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "cmd");
+	lmpdconn_coalesce_flush(L, lua_gettop(L));
+	lua_pop(L, 2);
+
+	/* Re-enter idle mode right away so no event is missed */
+	if (received && !mpd_send_idle(*dual->idle)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*dual->idle));
+		return 2;
+	}
+
+	lua_pushinteger(L, idle);
+	return 1;
+}
+
+static int lmpddual_run_password(lua_State *L)
+{
+	bool ret;
+	const char *password;
+	struct lmpd_dual *dual;
+
+	dual = luaL_checkudata(L, 1, MPD_DUAL_T);
+	password = luaL_checkstring(L, 2);
+
+	assert(*dual->cmd != NULL);
+	assert(*dual->idle != NULL);
+
+	/* The idle socket has to leave idle mode to authenticate, keep the
+	 * events it reports for the next recv_idle call. */
+	dual->pending |= mpd_run_noidle(*dual->idle);
+	ret = mpd_run_password(*dual->cmd, password)
+		&& mpd_run_password(*dual->idle, password);
+	/* A refused password leaves the idle socket usable */
+	if (mpd_connection_get_error(*dual->idle) == MPD_ERROR_SERVER)
+		mpd_connection_clear_error(*dual->idle);
+	if (!mpd_send_idle(*dual->idle)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*dual->idle));
+		return 2;
+	}
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+/* Calls the connection method in the first upvalue on the command socket */
+static int lmpddual_forward(lua_State *L)
+{
+	luaL_checkudata(L, 1, MPD_DUAL_T);
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "cmd");
+	lua_replace(L, 1);
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+static int lmpddual_index(lua_State *L)
+{
+	luaL_checkudata(L, 1, MPD_DUAL_T);
+	luaL_checkstring(L, 2);
+
+	lua_getmetatable(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1);
+
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (!lua_isfunction(L, -1))
+		return luaL_error(L, "Invalid key `%s'", lua_tostring(L, 2));
+
+	/* Cache the wrapper in the metatable, it does not depend on self */
+	lua_pushcclosure(L, lmpddual_forward, 1);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 3);
+	return 1;
+}
+
+static const luaL_reg lreg_dual[] = {
+	{"__gc",		lmpddual_close},
+	{"__index",		lmpddual_index},
+	{"close",		lmpddual_close},
+	{"command_connection",	lmpddual_command_connection},
+	{"idle_connection",	lmpddual_idle_connection},
+	{"get_idle_fd",		lmpddual_get_idle_fd},
+	{"recv_idle",		lmpddual_recv_idle},
+	{"run_password",	lmpddual_run_password},
+	{NULL,			NULL},
+};
+
+void linit_dual(lua_State *L)
+{
+	/* Register MPD_DUAL_T metatable */
+	luaL_newmetatable(L, MPD_DUAL_T);
+	luaL_register(L, NULL, lreg_dual);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_dual");
+	lua_pushcfunction(L, lmpddual_new);
+	lua_settable(L, -3);
+}
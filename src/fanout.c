@@ -0,0 +1,467 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Fanout:
+ * Sends one command to a group of connections at once. The command line
+ * is written to every socket first, then the responses are gathered with
+ * a single poll() loop as they arrive, so a broadcast takes about as long
+ * as the slowest server instead of the sum of all round trips.
+ *
+ * Like fast_list, this talks to the sockets directly. The members must not
+ * be in idle mode or have a response pending.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+
+#include "globals.h"
+
+#define LMPD_FANOUT_READ_SIZE	4096
+/* Sends due sooner than this are waited for without sleeping, seconds */
+#define LMPD_FANOUT_SPIN	0.002
+
+struct lmpd_fanout {
+	int n;
+};
+
+/* Pushes a copy of the array of connections at index idx, returns its
+ * length */
+int lmpd_fanout_check_members(lua_State *L, int idx)
+{
+	int i, n;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+	n = lua_objlen(L, idx);
+
+	lua_createtable(L, n, 0);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, idx, i);
+		if (!lua_getmetatable(L, -1))
+			luaL_argerror(L, idx, "array of connections expected");
+		luaL_getmetatable(L, MPD_CONNECTION_T);
+		if (!lua_rawequal(L, -1, -2))
+			luaL_argerror(L, idx, "array of connections expected");
+		lua_pop(L, 2);
+		lua_rawseti(L, -2, i);
+	}
+
+	return n;
+}
+
+/* mpdclient.new_fanout(conns) groups the connections of the array conns */
+static int lmpdfanout_new(lua_State *L)
+{
+	struct lmpd_fanout *fanout;
+
+	fanout = (struct lmpd_fanout *) lua_newuserdata(L, sizeof(struct lmpd_fanout));
+	fanout->n = 0;
+	luaL_getmetatable(L, MPD_FANOUT_T);
+	lua_setmetatable(L, -2);
+
+	/* The environment table holds the members */
+	fanout->n = lmpd_fanout_check_members(L, 1);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+/* Reads what is available for m, marking it done on a complete response */
+static void fanout_read(struct lmpd_fanout_member *m)
+{
+	ssize_t n;
+	char *data;
+	struct lmpd_buffer *buf;
+
+	buf = m->buf;
+	if (buf->size - buf->len < LMPD_FANOUT_READ_SIZE) {
+		data = realloc(buf->data, buf->size * 2 + LMPD_FANOUT_READ_SIZE);
+		if (data == NULL) {
+			m->error = "out of memory";
+			return;
+		}
+		buf->data = data;
+		buf->size = buf->size * 2 + LMPD_FANOUT_READ_SIZE;
+	}
+
+	n = read(m->fd, buf->data + buf->len, buf->size - buf->len);
+	if (n > 0) {
+		buf->len += n;
+		if (lmpd_response_complete(buf, &m->last))
+			m->done = true;
+	}
+	else if (n == 0)
+		m->error = "connection closed by the server";
+	else if (errno != EINTR && !lmpd_would_block(errno))
+		m->error = strerror(errno);
+}
+
+/* Writes the rest of the command line for m */
+static void fanout_write(struct lmpd_fanout_member *m, const char *cmd, size_t cmdlen)
+{
+	ssize_t n;
+
+	/* A server that went away must not raise SIGPIPE */
+	n = send(m->fd, cmd + m->sent, cmdlen - m->sent, MSG_NOSIGNAL);
+	if (n > 0)
+		m->sent += n;
+	else if (n < 0 && errno != EINTR && !lmpd_would_block(errno))
+		m->error = strerror(errno);
+}
+
+/* Drives the members for the connections in the array at idx until each
+ * one has a complete response, has failed or has run out of time. Members
+ * with a send time get their command line then, the last few milliseconds
+ * before it are waited out without sleeping. Deadlines are only slept for.
+ * A member failing once any of its command went out is out of step with
+ * its responses, its connection is poisoned. */
+void lmpd_fanout_exchange(lua_State *L, int idx, struct lmpd_fanout_member *members,
+		int n, const char *cmd, size_t cmdlen)
+{
+	int i, k, timeout, wait;
+	double now, next_send, next_deadline;
+	const char *errmsg;
+	struct pollfd *pfds;
+	struct lmpd_fanout_member *m;
+
+	pfds = (struct pollfd *) (members + n);
+
+	for (;;) {
+		now = lmpd_monotonic();
+		next_send = next_deadline = -1;
+		k = 0;
+		for (i = 0; i < n; i++) {
+			m = &members[i];
+			if (m->done || m->error != NULL)
+				continue;
+			if (!m->started && m->send_at > now) {
+				if (next_send < 0 || m->send_at < next_send)
+					next_send = m->send_at;
+				continue;
+			}
+			if (!m->started) {
+				m->started = true;
+				m->sent_at = now;
+				if (m->timeout > 0)
+					m->deadline = now + m->timeout;
+				fanout_write(m, cmd, cmdlen);
+				if (m->error != NULL)
+					continue;
+			}
+			if (m->deadline > 0 && now >= m->deadline) {
+				m->error = m->sent < cmdlen
+					? "timeout while sending the command"
+					: "timeout while receiving the response";
+				continue;
+			}
+			if (m->deadline > 0 && (next_deadline < 0 || m->deadline < next_deadline))
+				next_deadline = m->deadline;
+			pfds[k].fd = m->fd;
+			pfds[k].events = m->sent < cmdlen ? POLLOUT : POLLIN;
+			pfds[k].revents = 0;
+			k++;
+		}
+		if (k == 0 && next_send < 0 && next_deadline < 0)
+			break;
+
+		timeout = -1;
+		if (next_send >= 0)
+			timeout = next_send - now < LMPD_FANOUT_SPIN
+				? 0 : (int) ((next_send - now - LMPD_FANOUT_SPIN) * 1000);
+		if (next_deadline >= 0) {
+			/* Rounded up, waking early would spin until it */
+			wait = (int) ((next_deadline - now) * 1000) + 1;
+			if (timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+		if (poll(pfds, k, timeout) < 0 && errno != EINTR) {
+			errmsg = strerror(errno);
+			for (i = 0; i < n; i++) {
+				if (!members[i].done && members[i].error == NULL)
+					members[i].error = errmsg;
+			}
+			break;
+		}
+
+		now = lmpd_monotonic();
+		for (i = 0, k = 0; i < n; i++) {
+			m = &members[i];
+			if (m->done || m->error != NULL || !m->started)
+				continue;
+			if (pfds[k].revents != 0) {
+				if (m->sent < cmdlen)
+					fanout_write(m, cmd, cmdlen);
+				else {
+					fanout_read(m);
+					if (m->done)
+						m->done_at = now;
+				}
+			}
+			k++;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (members[i].error != NULL && members[i].sent > 0) {
+			lua_rawgeti(L, idx, i + 1);
+			lmpdconn_poison(L, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	}
+}
+
+/* Pushes a table of the name: value lines in [p, end), the first value of
+ * a name is kept */
+static void fanout_push_pairs(lua_State *L, const char *p, const char *end)
+{
+	const char *nl, *colon;
+
+	lua_newtable(L);
+	for (; p < end; p = nl + 1) {
+		nl = lmpd_scan(p, end, '\n');
+		if (nl == NULL)
+			nl = end;
+
+		colon = lmpd_scan(p, nl, ':');
+		if (colon == NULL || colon + 1 >= nl || colon[1] != ' ')
+			continue;
+
+		lua_pushlstring(L, p, colon - p);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushlstring(L, colon + 2, nl - colon - 2);
+			lua_rawset(L, -3);
+		}
+		else
+			lua_pop(L, 2);
+	}
+}
+
+/* Pushes scratch space for the n connections in the array at index idx
+ * and returns it, filled in for lmpd_fanout_exchange. Members whose
+ * connection is closed or broken have their error set already. */
+struct lmpd_fanout_member *lmpd_fanout_prepare(lua_State *L, int idx, int n)
+{
+	int i, top;
+	struct mpd_connection **conn;
+	struct lmpd_fanout_member *members, *m;
+
+	/* The poll set follows the members, collected with the call */
+	members = lua_newuserdata(L, n * (sizeof(struct lmpd_fanout_member)
+				+ sizeof(struct pollfd)) + 1);
+
+	for (i = 0; i < n; i++) {
+		m = &members[i];
+		m->fd = -1;
+		m->timeout = 0;
+		m->send_at = 0;
+		m->sent_at = 0;
+		m->done_at = 0;
+		m->deadline = 0;
+		m->started = false;
+		m->sent = 0;
+		m->buf = NULL;
+		m->error = NULL;
+		m->done = false;
+		m->last = 0;
+
+		lua_rawgeti(L, idx, i + 1);
+		top = lua_gettop(L);
+		conn = luaL_checkudata(L, top, MPD_CONNECTION_T);
+		if (*conn == NULL)
+			m->error = "connection is closed";
+		else if (lmpdconn_busy(L, top))
+			m->error = "connection is busy with a prefetch";
+		else if (lmpdconn_poisoned(L, top))
+			m->error = "connection was cut after a failed exchange";
+		else if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS)
+			m->error = mpd_connection_get_error_message(*conn);
+		else {
+			m->fd = mpd_connection_get_fd(*conn);
+			m->buf = lmpdconn_buffer(L, top);
+			m->buf->len = 0;
+
+			lua_getfenv(L, top);
+			lua_getfield(L, -1, "timeout");
+			if (lua_tonumber(L, -1) > 0)
+				m->timeout = lua_tonumber(L, -1) / 1000;
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+	}
+
+	return members;
+}
+
+/* Pushes two arrays indexed like the members: the response pairs of each
+ * member or false, and the error messages of the failed ones */
+void lmpd_fanout_push_results(lua_State *L, const struct lmpd_fanout_member *members, int n)
+{
+	int i;
+	const struct lmpd_fanout_member *m;
+	const struct lmpd_buffer *buf;
+
+	lua_createtable(L, n, 0);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		m = &members[i];
+		buf = m->buf;
+		if (m->error != NULL) {
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushstring(L, m->error);
+			lua_rawseti(L, -2, i + 1);
+		}
+		else if (buf->data[m->last] == 'A') {
+			lua_pushboolean(L, 0);
+			lua_rawseti(L, -3, i + 1);
+			lua_pushlstring(L, buf->data + m->last + 4, buf->len - m->last - 5);
+			lua_rawseti(L, -2, i + 1);
+		}
+		else {
+			fanout_push_pairs(L, buf->data, buf->data + m->last);
+			lua_rawseti(L, -3, i + 1);
+		}
+	}
+}
+
+/* Checks the command name and arguments from index idx on and pushes the
+ * command line */
+const char *lmpd_fanout_check_command(lua_State *L, int idx, size_t *cmdlen)
+{
+	int i, argc;
+	const char *name;
+	const char *argv[LMPD_ARGV_MAX];
+
+	name = luaL_checkstring(L, idx);
+
+	argc = lua_gettop(L) - idx;
+	if (argc > LMPD_ARGV_MAX)
+		luaL_error(L, "too many arguments, at most %d are supported", LMPD_ARGV_MAX);
+	for (i = 0; i < argc; i++)
+		argv[i] = luaL_checkstring(L, idx + 1 + i);
+
+	lmpd_push_command_argv(L, name, argc, argv);
+	return lua_tolstring(L, -1, cmdlen);
+}
+
+/* fanout:run(name, ...) sends the command to every member and returns the
+ * response pairs of each member or false, and the error messages */
+static int lmpdfanout_run(lua_State *L)
+{
+	size_t cmdlen;
+	const char *cmd;
+	struct lmpd_fanout *fanout;
+	struct lmpd_fanout_member *members;
+
+	fanout = luaL_checkudata(L, 1, MPD_FANOUT_T);
+	cmd = lmpd_fanout_check_command(L, 2, &cmdlen);
+
+	lua_getfenv(L, 1);
+	members = lmpd_fanout_prepare(L, lua_gettop(L), fanout->n);
+
+	lmpd_fanout_exchange(L, lua_gettop(L) - 1, members, fanout->n, cmd, cmdlen);
+
+	lmpd_fanout_push_results(L, members, fanout->n);
+	return 2;
+}
+
+static int lmpdfanout_len(lua_State *L)
+{
+	struct lmpd_fanout *fanout;
+
+	fanout = luaL_checkudata(L, 1, MPD_FANOUT_T);
+
+	lua_pushinteger(L, fanout->n);
+	return 1;
+}
+
+static int lmpdfanout_index(lua_State *L)
+{
+	int i;
+	const char *key;
+	struct lmpd_fanout *fanout;
+
+	fanout = luaL_checkudata(L, 1, MPD_FANOUT_T);
+
+	if (lua_isnumber(L, 2)) {
+		/* fanout[i] is the i-th member */
+		i = lua_tointeger(L, 2);
+		if (i < 1 || i > fanout->n)
+			return 0;
+		lua_getfenv(L, 1);
+		lua_rawgeti(L, -1, i);
+		return 1;
+	}
+
+	key = luaL_checkstring(L, 2);
+	if (strncmp(key, "run", 4) == 0)
+		lua_pushcfunction(L, lmpdfanout_run);
+	else if (strncmp(key, "count", 6) == 0)
+		lua_pushinteger(L, fanout->n);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+
+	return 1;
+}
+
+static const luaL_reg lreg_fanout[] = {
+	{"__index",	lmpdfanout_index},
+	{"__len",	lmpdfanout_len},
+	{NULL,		NULL},
+};
+
+void linit_fanout(lua_State *L)
+{
+	/* Register MPD_FANOUT_T metatable */
+	luaL_newmetatable(L, MPD_FANOUT_T);
+	luaL_register(L, NULL, lreg_fanout);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_fanout");
+	lua_pushcfunction(L, lmpdfanout_new);
+	lua_settable(L, -3);
+}
@@ -34,30 +34,204 @@
 #ifndef _LUA_GLOBALS_H_
 #define _LUA_GLOBALS_H_ 1
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <lua.h>
 
+#define MPD_BUFFER_T		"MpdClient.Buffer"
+#define MPD_CLOCK_T		"MpdClient.Clock"
 #define MPD_CONNECTION_T	"MpdClient.Connection"
 #define MPD_DIRECTORY_T		"MpdClient.Directory"
+#define MPD_DIRCACHE_T		"MpdClient.DirCache"
+#define MPD_DUAL_T		"MpdClient.Dual"
 #define MPD_ENTITY_T		"MpdClient.Entity"
+#define MPD_FANOUT_T		"MpdClient.Fanout"
+#define MPD_IOENGINE_T		"MpdClient.IOEngine"
+#define MPD_LAZYSONG_T		"MpdClient.LazySong"
+#define MPD_MANAGED_T		"MpdClient.Managed"
 #define MPD_OUTPUT_T		"MpdClient.Output"
 #define MPD_PAIR_T		"MpdClient.Pair"
 #define MPD_PLAYLIST_T		"MpdClient.Playlist"
+#define MPD_PLAYSYNC_T		"MpdClient.PlaySync"
+#define MPD_PREFETCH_T		"MpdClient.Prefetch"
+#define MPD_QUEUECACHE_T	"MpdClient.QueueCache"
+#define MPD_SONGSEARCH_T	"MpdClient.SongSearch"
+#define MPD_SONGSTORE_T		"MpdClient.SongStore"
 #define MPD_SONG_T		"MpdClient.Song"
 #define MPD_STATS_T		"MpdClient.Stats"
 #define MPD_STATUS_T		"MpdClient.Status"
+#define MPD_SYNC_T		"MpdClient.Sync"
+#define MPD_UPDATEFUTURE_T	"MpdClient.UpdateFuture"
+#define MPD_UPDATESCHEDULER_T	"MpdClient.UpdateScheduler"
 
+void linit_clock(lua_State *L);
+void linit_coalesce(lua_State *L);
 void linit_connection(lua_State *L);
+void linit_crawl(lua_State *L);
+void linit_dircache(lua_State *L);
 void linit_directory(lua_State *L);
+void linit_dual(lua_State *L);
 void linit_entity(lua_State *L);
 void linit_error(lua_State *L);
+void linit_fanout(lua_State *L);
+void linit_group(lua_State *L);
 void linit_idle(lua_State *L);
+void linit_ioengine(lua_State *L);
+void linit_lazysong(lua_State *L);
+void linit_managed(lua_State *L);
 void linit_output(lua_State *L);
 void linit_pair(lua_State *L);
+void linit_parser(lua_State *L);
 void linit_playlist(lua_State *L);
+void linit_playsync(lua_State *L);
+void linit_prefetch(lua_State *L);
 void linit_protocol(lua_State *L);
+void linit_queuecache(lua_State *L);
+void linit_snapshot(lua_State *L);
 void linit_song(lua_State *L);
+void linit_songsearch(lua_State *L);
+void linit_songstore(lua_State *L);
+void linit_sort(lua_State *L);
 void linit_stats(lua_State *L);
 void linit_status(lua_State *L);
+void linit_sync(lua_State *L);
+void linit_update(lua_State *L);
+
+/* clock.c */
+double lmpd_monotonic(void);
+
+/* connection.c */
+#define LMPD_ARGV_MAX	64
+
+struct mpd_connection;
+struct mpd_connection **lmpdconn_newuserdata(lua_State *L, double timeout);
+bool lmpdconn_busy(lua_State *L, int idx);
+bool lmpdconn_poisoned(lua_State *L, int idx);
+void lmpdconn_poison(lua_State *L, int idx);
+struct mpd_connection **lmpdconn_check(lua_State *L, int idx);
+bool lmpd_send_argv(struct mpd_connection *conn, const char *command,
+		int argc, const char *const *argv);
+bool lmpd_send_queue_range(struct mpd_connection *conn, unsigned start, unsigned end);
+void lmpd_push_songs(lua_State *L, struct mpd_connection *conn);
+
+/* parser.c */
+struct lmpd_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+const char *lmpd_scan(const char *p, const char *end, int c);
+bool lmpd_would_block(int err);
+void lmpd_poison(int fd);
+struct lmpd_buffer *lmpdconn_buffer(lua_State *L, int idx);
+int lmpd_response_complete(const struct lmpd_buffer *buf, size_t *last);
+void lmpd_push_command_argv(lua_State *L, const char *command, int argc, const char *const *argv);
+void lmpd_push_command_line(lua_State *L, const char *command, const char *arg);
+int lmpdconn_exchange(lua_State *L, int idx, const char *cmd, size_t cmdlen,
+		const char **block, size_t *blocklen);
+
+/* prefetch.c */
+void lmpd_prefetch_cancel(lua_State *L, int idx);
+
+/* ioengine.c */
+#define LMPD_IOERROR_MAX	256
+
+/* A response split into pairs and entities off the Lua thread */
+struct lmpd_ioresult {
+	unsigned id;
+	bool failed;
+	char error[LMPD_IOERROR_MAX];
+	/* Names and values, each NUL terminated */
+	char *text;
+	size_t text_len, text_size;
+	/* Name offset, name length, value offset and value length of each pair */
+	uint32_t *pairs;
+	unsigned npairs, pairs_size;
+	/* Index of the pair starting each entity */
+	uint32_t *starts;
+	unsigned nentities, starts_size;
+};
+
+bool lmpd_ioresult_starts_entity(const char *name);
+bool lmpd_ioresult_add_pair(struct lmpd_ioresult *res, const char *name, const char *value);
+void lmpd_ioresult_fail(struct lmpd_ioresult *res, const char *msg);
+void lmpd_ioresult_free(struct lmpd_ioresult *res);
+void lmpd_ioresult_push_pairs(lua_State *L, const struct lmpd_ioresult *res);
+void lmpd_ioresult_push_entities(lua_State *L, const struct lmpd_ioresult *res);
+
+/* fanout.c */
+struct lmpd_fanout_member {
+	int fd;
+	/* Seconds, zero for none */
+	double timeout;
+	/* When to send the command, zero for right away */
+	double send_at;
+	/* When it was sent and when the response was complete */
+	double sent_at, done_at;
+	double deadline;
+	bool started;
+	size_t sent;
+	struct lmpd_buffer *buf;
+	/* Set when the member failed before completing */
+	const char *error;
+	bool done;
+	/* Start of the OK or ACK line */
+	size_t last;
+};
+
+int lmpd_fanout_check_members(lua_State *L, int idx);
+const char *lmpd_fanout_check_command(lua_State *L, int idx, size_t *cmdlen);
+struct lmpd_fanout_member *lmpd_fanout_prepare(lua_State *L, int idx, int n);
+void lmpd_fanout_exchange(lua_State *L, int idx, struct lmpd_fanout_member *members,
+		int n, const char *cmd, size_t cmdlen);
+void lmpd_fanout_push_results(lua_State *L, const struct lmpd_fanout_member *members, int n);
+
+/* coalesce.c */
+void lmpdconn_coalesce_flush(lua_State *L, int idx);
+
+/* songstore.c */
+struct lmpd_arena_chunk;
+
+/* Songs in columns indexed by row. Strings live in the arena with their
+ * length stored in the four bytes before them and are referred to by id,
+ * zero meaning none. Tag values are interned, uris are not. */
+
+struct lmpd_songstore {
+	struct lmpd_arena_chunk *chunks;
+	size_t bytes;
+
+	const char **strings;
+	uint32_t nstrings;
+	uint32_t strings_size;
+	uint32_t *hash;
+	uint32_t hash_size;
+	uint32_t ninterned;
+
+	unsigned nrows;
+	unsigned rows_size;
+	uint32_t *uris;
+	unsigned *durations;
+	/* MPD_TAG_COUNT columns, allocated when a tag first occurs */
+	uint32_t **columns;
+
+	/* Userdata and snapshots referring to the store, see snapshot.c. A
+	 * frozen store is never modified again and may be read by any
+	 * thread. */
+	unsigned refs;
+	bool frozen;
+};
+
+#define lmpd_songstore_string(store, id)	((store)->strings[(id)])
+#define lmpd_songstore_strlen(store, id)	(((const uint32_t *)(store)->strings[(id)])[-1])
+
+struct lmpd_songstore *lmpd_songstore_check(lua_State *L, int idx);
+void lmpd_songstore_push(lua_State *L, struct lmpd_songstore *store);
+void lmpd_songstore_ref(struct lmpd_songstore *store);
+void lmpd_songstore_unref(struct lmpd_songstore *store);
+const char *lmpd_songstore_tag(const struct lmpd_songstore *store, unsigned row, int tag);
 
 /* Helper functions */
 #if 0
@@ -0,0 +1,575 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Grouping:
+ * mpdclient.group() aggregates an array of songs, or the rows of a song
+ * store, by a list of tags without building a table per song. Tag values
+ * are reduced to ids, interned ones for a store and through a local table
+ * otherwise, so groups are found by hashing tuples of integers. Distinct
+ * counts hash (group, value) pairs into one set. The result is a table of
+ * flat arrays, one per key and one per aggregate.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/song.h>
+#include <mpd/tag.h>
+
+#include "globals.h"
+
+#define LMPD_GROUP_KEYS_MAX	8
+#define LMPD_GROUP_AGGS_MAX	16
+/* The song duration as an aggregate field */
+#define LMPD_GROUP_DURATION	(-1)
+
+enum lmpd_group_op {
+	LMPD_GROUP_COUNT,
+	LMPD_GROUP_SUM,
+	LMPD_GROUP_MIN,
+	LMPD_GROUP_MAX,
+	LMPD_GROUP_DISTINCT,
+};
+
+static const char *const group_ops[] = {
+	"count", "sum", "min", "max", "distinct", NULL,
+};
+
+/* Local string ids for song arrays, the strings belong to the songs */
+struct lmpd_group_intern {
+	const char **strings;
+	uint32_t nstrings;
+	uint32_t strings_size;
+	uint32_t *hash;
+	uint32_t hash_size;
+};
+
+struct lmpd_group {
+	int keys[LMPD_GROUP_KEYS_MAX];
+	int nkeys;
+	enum lmpd_group_op ops[LMPD_GROUP_AGGS_MAX];
+	int fields[LMPD_GROUP_AGGS_MAX];
+	int naggs;
+
+	/* nkeys ids and naggs states per group */
+	uint32_t *ids;
+	lua_Number *states;
+	uint32_t ngroups;
+	uint32_t groups_size;
+
+	/* Group index plus one by hash of the key ids */
+	uint32_t *table;
+	uint32_t table_size;
+
+	/* Distinct (aggregate, group, value) triples, zero is empty */
+	uint64_t *distinct;
+	size_t ndistinct;
+	size_t distinct_size;
+};
+
+static uint32_t group_hash_string(const char *s)
+{
+	uint32_t h;
+
+	/* FNV-1a */
+	for (h = 2166136261u; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static inline uint64_t group_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	return h;
+}
+
+static bool intern_init(struct lmpd_group_intern *in)
+{
+	in->strings_size = 1024;
+	in->hash_size = 2048;
+	in->strings = malloc(in->strings_size * sizeof(const char *));
+	in->hash = calloc(in->hash_size, sizeof(uint32_t));
+	in->nstrings = 1;
+	return in->strings != NULL && in->hash != NULL;
+}
+
+static void intern_free(struct lmpd_group_intern *in)
+{
+	free(in->strings);
+	free(in->hash);
+}
+
+/* Returns the id of s, zero for NULL or without memory */
+static uint32_t intern_get(struct lmpd_group_intern *in, const char *s)
+{
+	uint32_t i, j, id, mask, size;
+	uint32_t *hash;
+	const char **strings;
+
+	if (s == NULL)
+		return 0;
+
+	if (in->nstrings >= in->hash_size / 2) {
+		size = in->hash_size * 2;
+		hash = calloc(size, sizeof(uint32_t));
+		if (hash == NULL)
+			return 0;
+		for (i = 0; i < in->hash_size; i++) {
+			if (in->hash[i] == 0)
+				continue;
+			j = group_hash_string(in->strings[in->hash[i]]) & (size - 1);
+			while (hash[j] != 0)
+				j = (j + 1) & (size - 1);
+			hash[j] = in->hash[i];
+		}
+		free(in->hash);
+		in->hash = hash;
+		in->hash_size = size;
+	}
+
+	mask = in->hash_size - 1;
+	for (i = group_hash_string(s) & mask; in->hash[i] != 0; i = (i + 1) & mask) {
+		if (strcmp(in->strings[in->hash[i]], s) == 0)
+			return in->hash[i];
+	}
+
+	if (in->nstrings == in->strings_size) {
+		strings = realloc(in->strings, in->strings_size * 2 * sizeof(const char *));
+		if (strings == NULL)
+			return 0;
+		in->strings = strings;
+		in->strings_size *= 2;
+	}
+	id = in->nstrings++;
+	in->strings[id] = s;
+	in->hash[i] = id;
+	return id;
+}
+
+static bool group_grow_table(struct lmpd_group *group)
+{
+	uint32_t i, j, g, size, mask;
+	uint64_t h;
+	uint32_t *table;
+
+	size = group->table_size * 2;
+	table = calloc(size, sizeof(uint32_t));
+	if (table == NULL)
+		return false;
+
+	mask = size - 1;
+	for (i = 0; i < group->table_size; i++) {
+		g = group->table[i];
+		if (g == 0)
+			continue;
+		h = 0;
+		for (j = 0; j < (uint32_t) group->nkeys; j++)
+			h = group_mix(h ^ group->ids[(g - 1) * group->nkeys + j]);
+		for (j = h & mask; table[j] != 0; j = (j + 1) & mask)
+			;
+		table[j] = g;
+	}
+
+	free(group->table);
+	group->table = table;
+	group->table_size = size;
+	return true;
+}
+
+/* Returns the index of the group with the key ids, adding it when new,
+ * or UINT32_MAX without memory */
+static uint32_t group_find(struct lmpd_group *group, const uint32_t *ids)
+{
+	int a, j;
+	uint32_t i, g, mask, size;
+	uint64_t h;
+	uint32_t *gids;
+	lua_Number *states;
+
+	if (group->ngroups >= group->table_size / 2 && !group_grow_table(group))
+		return UINT32_MAX;
+
+	h = 0;
+	for (j = 0; j < group->nkeys; j++)
+		h = group_mix(h ^ ids[j]);
+
+	mask = group->table_size - 1;
+	for (i = h & mask; group->table[i] != 0; i = (i + 1) & mask) {
+		g = group->table[i] - 1;
+		if (memcmp(group->ids + (size_t) g * group->nkeys, ids,
+					group->nkeys * sizeof(uint32_t)) == 0)
+			return g;
+	}
+
+	if (group->ngroups == group->groups_size) {
+		size = group->groups_size * 2;
+		gids = realloc(group->ids, (size_t) size * group->nkeys * sizeof(uint32_t));
+		if (gids == NULL)
+			return UINT32_MAX;
+		group->ids = gids;
+		states = realloc(group->states, (size_t) size * group->naggs * sizeof(lua_Number) + 1);
+		if (states == NULL)
+			return UINT32_MAX;
+		group->states = states;
+		group->groups_size = size;
+	}
+
+	g = group->ngroups++;
+	memcpy(group->ids + (size_t) g * group->nkeys, ids, group->nkeys * sizeof(uint32_t));
+	for (a = 0; a < group->naggs; a++) {
+		/* min and max stay infinite until a value comes */
+		if (group->ops[a] == LMPD_GROUP_MIN)
+			group->states[(size_t) g * group->naggs + a] = HUGE_VAL;
+		else if (group->ops[a] == LMPD_GROUP_MAX)
+			group->states[(size_t) g * group->naggs + a] = -HUGE_VAL;
+		else
+			group->states[(size_t) g * group->naggs + a] = 0;
+	}
+	group->table[i] = g + 1;
+	return g;
+}
+
+/* Adds the triple to the distinct set, returns whether it was new or -1
+ * without memory */
+static int group_distinct_add(struct lmpd_group *group, int a, uint32_t g, uint32_t value)
+{
+	size_t i, j, size, mask;
+	uint64_t key, *set;
+
+	if (group->ndistinct >= group->distinct_size / 2) {
+		size = group->distinct_size * 2;
+		set = calloc(size, sizeof(uint64_t));
+		if (set == NULL)
+			return -1;
+		for (i = 0; i < group->distinct_size; i++) {
+			if (group->distinct[i] == 0)
+				continue;
+			for (j = group_mix(group->distinct[i]) & (size - 1); set[j] != 0; j = (j + 1) & (size - 1))
+				;
+			set[j] = group->distinct[i];
+		}
+		free(group->distinct);
+		group->distinct = set;
+		group->distinct_size = size;
+	}
+
+	/* 4 bits of aggregate, 28 of group and 32 of value, plus one */
+	key = (((uint64_t) a << 60) | ((uint64_t) g << 32) | value) + 1;
+	mask = group->distinct_size - 1;
+	for (i = group_mix(key) & mask; group->distinct[i] != 0; i = (i + 1) & mask) {
+		if (group->distinct[i] == key)
+			return 0;
+	}
+	group->distinct[i] = key;
+	group->ndistinct++;
+	return 1;
+}
+
+static void group_free(struct lmpd_group *group)
+{
+	free(group->ids);
+	free(group->states);
+	free(group->table);
+	free(group->distinct);
+}
+
+/* Parses a field name: a tag name or constant, or "duration" */
+static int group_check_field(lua_State *L, int idx, int arg)
+{
+	int tag;
+	const char *name;
+
+	if (lua_type(L, idx) == LUA_TNUMBER)
+		tag = lua_tointeger(L, idx);
+	else {
+		name = luaL_checkstring(L, idx);
+		if (strncmp(name, "duration", 9) == 0)
+			return LMPD_GROUP_DURATION;
+		tag = mpd_tag_name_iparse(name);
+	}
+	luaL_argcheck(L, tag >= 0 && tag < MPD_TAG_COUNT, arg, "unknown field");
+	return tag;
+}
+
+/* Reads aggregate specs: "count" or {op, field}, the field defaults to
+ * the duration */
+static void group_check_aggregates(lua_State *L, int idx, struct lmpd_group *group)
+{
+	int i, op;
+
+	for (i = 1; ; i++) {
+		lua_rawgeti(L, idx, i);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		luaL_argcheck(L, group->naggs < LMPD_GROUP_AGGS_MAX, idx, "too many aggregates");
+		if (lua_istable(L, -1)) {
+			lua_rawgeti(L, -1, 1);
+			op = luaL_checkoption(L, -1, NULL, group_ops);
+			lua_rawgeti(L, -2, 2);
+			group->fields[group->naggs] = lua_isnil(L, -1)
+				? LMPD_GROUP_DURATION : group_check_field(L, -1, idx);
+			lua_pop(L, 2);
+		}
+		else {
+			op = luaL_checkoption(L, -1, NULL, group_ops);
+			group->fields[group->naggs] = LMPD_GROUP_DURATION;
+		}
+		group->ops[group->naggs++] = op;
+		lua_pop(L, 1);
+	}
+}
+
+/* mpdclient.group(songs, keys[, aggregates]) groups an array of MPD_SONG_T
+ * or a song store by the tags in keys. aggregates lists "count",
+ * {"sum", field}, {"min", field}, {"max", field} and {"distinct", field}
+ * where field is a tag or "duration"; sum, min and max read numbers from
+ * tags and songs missing the field are left out. Returns a table with one
+ * array per key, holding the key values of the groups ("" when missing),
+ * followed by one array per aggregate, nil for min and max of groups
+ * without values, and the number of groups in n. */
+static int lmpd_group(lua_State *L)
+{
+	bool oom;
+	int a, j, r;
+	unsigned i, n;
+	uint32_t g, id, value;
+	uint32_t ids[LMPD_GROUP_KEYS_MAX];
+	lua_Number number, *state;
+	const char *s;
+	char *end;
+	struct lmpd_group group;
+	struct lmpd_group_intern in;
+	struct lmpd_songstore *store;
+	struct mpd_song **song;
+
+	store = NULL;
+	if (lua_type(L, 1) == LUA_TUSERDATA)
+		store = lmpd_songstore_check(L, 1);
+	else
+		luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (lua_isnoneornil(L, 3)) {
+		lua_settop(L, 2);
+		lua_createtable(L, 1, 0);
+		lua_pushliteral(L, "count");
+		lua_rawseti(L, -2, 1);
+	}
+	else
+		luaL_checktype(L, 3, LUA_TTABLE);
+	lua_settop(L, 3);
+
+	memset(&group, 0, sizeof(struct lmpd_group));
+	for (j = 1; ; j++) {
+		lua_rawgeti(L, 2, j);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		luaL_argcheck(L, group.nkeys < LMPD_GROUP_KEYS_MAX, 2, "too many keys");
+		group.keys[group.nkeys] = group_check_field(L, -1, 2);
+		luaL_argcheck(L, group.keys[group.nkeys] != LMPD_GROUP_DURATION, 2, "keys must be tags");
+		group.nkeys++;
+		lua_pop(L, 1);
+	}
+	group_check_aggregates(L, 3, &group);
+
+	n = store != NULL ? store->nrows : lua_objlen(L, 1);
+	if (store == NULL) {
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 1, i);
+			song = luaL_checkudata(L, -1, MPD_SONG_T);
+			luaL_argcheck(L, *song != NULL, 1, "freed song");
+			lua_pop(L, 1);
+		}
+	}
+
+	/* No Lua errors from here until the results are pushed */
+	memset(&in, 0, sizeof(struct lmpd_group_intern));
+	group.groups_size = 256;
+	group.table_size = 512;
+	group.distinct_size = 1024;
+	group.ids = malloc(group.groups_size * (group.nkeys + 1) * sizeof(uint32_t));
+	group.states = malloc(group.groups_size * (group.naggs + 1) * sizeof(lua_Number));
+	group.table = calloc(group.table_size, sizeof(uint32_t));
+	group.distinct = calloc(group.distinct_size, sizeof(uint64_t));
+	oom = group.ids == NULL || group.states == NULL || group.table == NULL
+		|| group.distinct == NULL || (store == NULL && !intern_init(&in));
+
+	song = NULL;
+	for (i = 0; !oom && i < n; i++) {
+		if (store == NULL) {
+			lua_rawgeti(L, 1, i + 1);
+			song = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+		}
+
+		for (j = 0; j < group.nkeys; j++) {
+			if (store != NULL) {
+				ids[j] = store->columns[group.keys[j]] != NULL
+					? store->columns[group.keys[j]][i] : 0;
+			}
+			else {
+				s = mpd_song_get_tag(*song, group.keys[j], 0);
+				ids[j] = intern_get(&in, s);
+				if (s != NULL && ids[j] == 0)
+					oom = true;
+			}
+		}
+		g = group_find(&group, ids);
+		if (oom || g == UINT32_MAX) {
+			oom = true;
+			break;
+		}
+
+		state = group.states + (size_t) g * group.naggs;
+		for (a = 0; !oom && a < group.naggs; a++) {
+			/* Value id for distinct, number for the others, missing
+			 * values are left out */
+			if (group.fields[a] == LMPD_GROUP_DURATION) {
+				value = store != NULL ? store->durations[i] : mpd_song_get_duration(*song);
+				number = value;
+			}
+			else {
+				value = 0;
+				if (store != NULL) {
+					if (store->columns[group.fields[a]] != NULL)
+						value = store->columns[group.fields[a]][i];
+					s = lmpd_songstore_string(store, value);
+				}
+				else
+					s = mpd_song_get_tag(*song, group.fields[a], 0);
+				if (s == NULL)
+					continue;
+
+				if (group.ops[a] == LMPD_GROUP_DISTINCT && store == NULL) {
+					value = intern_get(&in, s);
+					oom = value == 0;
+				}
+				else if (group.ops[a] != LMPD_GROUP_COUNT
+						&& group.ops[a] != LMPD_GROUP_DISTINCT) {
+					number = strtod(s, &end);
+					if (end == s)
+						continue;
+				}
+			}
+
+			switch (group.ops[a]) {
+			case LMPD_GROUP_COUNT:
+				state[a]++;
+				break;
+			case LMPD_GROUP_SUM:
+				state[a] += number;
+				break;
+			case LMPD_GROUP_MIN:
+				if (number < state[a])
+					state[a] = number;
+				break;
+			case LMPD_GROUP_MAX:
+				if (number > state[a])
+					state[a] = number;
+				break;
+			case LMPD_GROUP_DISTINCT:
+				if (oom)
+					break;
+				r = group_distinct_add(&group, a, g, value);
+				if (r < 0)
+					oom = true;
+				else
+					state[a] += r;
+				break;
+			}
+		}
+	}
+	if (oom) {
+		group_free(&group);
+		intern_free(&in);
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+
+	lua_createtable(L, group.nkeys + group.naggs, 1);
+	for (j = 0; j < group.nkeys; j++) {
+		lua_createtable(L, group.ngroups, 0);
+		for (g = 0; g < group.ngroups; g++) {
+			id = group.ids[(size_t) g * group.nkeys + j];
+			if (id == 0)
+				lua_pushliteral(L, "");
+			else if (store != NULL)
+				lua_pushlstring(L, lmpd_songstore_string(store, id),
+						lmpd_songstore_strlen(store, id));
+			else
+				lua_pushstring(L, in.strings[id]);
+			lua_rawseti(L, -2, g + 1);
+		}
+		lua_rawseti(L, -2, j + 1);
+	}
+	for (a = 0; a < group.naggs; a++) {
+		lua_createtable(L, group.ngroups, 0);
+		for (g = 0; g < group.ngroups; g++) {
+			number = group.states[(size_t) g * group.naggs + a];
+			if (isinf(number))
+				continue;
+			lua_pushnumber(L, number);
+			lua_rawseti(L, -2, g + 1);
+		}
+		lua_rawseti(L, -2, group.nkeys + a + 1);
+	}
+	lua_pushinteger(L, group.ngroups);
+	lua_setfield(L, -2, "n");
+
+	group_free(&group);
+	intern_free(&in);
+	return 1;
+}
+
+void linit_group(lua_State *L)
+{
+	lua_pushliteral(L, "group");
+	lua_pushcfunction(L, lmpd_group);
+	lua_settable(L, -3);
+}
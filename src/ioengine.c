@@ -0,0 +1,737 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* I/O engine:
+ * Owns an mpd_connection on a background thread so that latency sensitive
+ * code never touches the socket. Commands are handed to the thread through
+ * a lock-free single producer, single consumer ring and the decoded
+ * responses come back through a second one. The thread splits responses
+ * into pairs and entities itself, the Lua side only creates the strings.
+ *
+ * A file descriptor becomes readable when results are waiting, so the
+ * engine can be polled together with other descriptors. It is an eventfd
+ * where available and a pipe otherwise. Either side only writes to it when
+ * the other has emptied its ring, so a busy engine costs no system calls
+ * beyond the ones talking to the server.
+ *
+ * An engine belongs to one Lua state. A connection that breaks is opened
+ * again for the next command.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/pair.h>
+#include <mpd/recv.h>
+#include <mpd/response.h>
+
+#include "globals.h"
+
+/* Commands in flight at most, a power of two */
+#define LMPD_IORING_SIZE	256
+#define LMPD_IORING_PAD		64
+
+struct lmpd_ioring {
+	/* Written by the producer only */
+	unsigned head;
+	char pad0[LMPD_IORING_PAD - sizeof(unsigned)];
+	/* Written by the consumer only */
+	unsigned tail;
+	char pad1[LMPD_IORING_PAD - sizeof(unsigned)];
+	void *slots[LMPD_IORING_SIZE];
+};
+
+struct lmpd_ionotify {
+	/* Read end and write end, the same descriptor for an eventfd */
+	int fds[2];
+};
+
+struct lmpd_iorequest {
+	/* Allocated with the request, so a result can always be posted */
+	struct lmpd_ioresult *res;
+	int argc;
+	const char *name;
+	const char *argv[LMPD_ARGV_MAX];
+	/* The name and the arguments */
+	char data[];
+};
+
+struct lmpd_ioengine {
+	char *host;
+	int port;
+	unsigned timeout;
+	pthread_t thread;
+	bool running;
+	/* Set by close, read by the thread */
+	bool stop;
+	/* Used by the thread only */
+	struct mpd_connection *conn;
+	/* Used by the Lua side only */
+	unsigned next_id;
+	unsigned inflight;
+	struct lmpd_ionotify wake;
+	struct lmpd_ionotify done;
+	struct lmpd_ioring submit;
+	struct lmpd_ioring complete;
+};
+
+static void ioring_init(struct lmpd_ioring *ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/* Adds p to the ring, which must not be full. Returns true when the
+ * consumer had taken everything before p and may be about to sleep, the
+ * caller must wake it then. The head is stored before the tail is loaded
+ * and ioring_pop does the opposite, so with sequentially consistent order
+ * at least one side sees the other. */
+static bool ioring_push(struct lmpd_ioring *ring, void *p)
+{
+	unsigned head;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	assert(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < LMPD_IORING_SIZE);
+
+	ring->slots[head & (LMPD_IORING_SIZE - 1)] = p;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+/* Takes the oldest entry off the ring, NULL when it is empty */
+static void *ioring_pop(struct lmpd_ioring *ring)
+{
+	void *p;
+	unsigned tail;
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+		return NULL;
+
+	p = ring->slots[tail & (LMPD_IORING_SIZE - 1)];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+	return p;
+}
+
+static bool ionotify_open(struct lmpd_ionotify *notify)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	notify->fds[0] = notify->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return notify->fds[0] >= 0;
+#else
+	int i;
+
+	if (pipe(notify->fds) < 0)
+		return false;
+	for (i = 0; i < 2; i++) {
+		fcntl(notify->fds[i], F_SETFL, fcntl(notify->fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(notify->fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	return true;
+#endif
+}
+
+static void ionotify_close(struct lmpd_ionotify *notify)
+{
+	if (notify->fds[0] < 0)
+		return;
+	close(notify->fds[0]);
+	if (notify->fds[1] != notify->fds[0])
+		close(notify->fds[1]);
+	notify->fds[0] = notify->fds[1] = -1;
+}
+
+/* Makes the read end readable. A full pipe is readable already. */
+static void ionotify_signal(struct lmpd_ionotify *notify)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+
+	while (write(notify->fds[1], &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+#else
+	char c = 0;
+
+	while (write(notify->fds[1], &c, 1) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+/* Resets the read end, must come before emptying the ring it guards */
+static void ionotify_drain(struct lmpd_ionotify *notify)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t value;
+
+	while (read(notify->fds[0], &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+#else
+	char buf[64];
+	ssize_t n;
+
+	do {
+		n = read(notify->fds[0], buf, sizeof(buf));
+	} while (n > 0 || (n < 0 && errno == EINTR));
+#endif
+}
+
+void lmpd_ioresult_free(struct lmpd_ioresult *res)
+{
+	free(res->text);
+	free(res->pairs);
+	free(res->starts);
+	free(res);
+}
+
+void lmpd_ioresult_fail(struct lmpd_ioresult *res, const char *msg)
+{
+	res->failed = true;
+	snprintf(res->error, sizeof(res->error), "%s", msg);
+}
+
+/* Grows the array at *p to hold n more elements of size bytes */
+static bool ioresult_reserve(void **p, size_t *cap, size_t len, size_t n, size_t size)
+{
+	void *q;
+	size_t newcap;
+
+	if (len + n <= *cap)
+		return true;
+
+	newcap = *cap > 0 ? *cap * 2 : 64;
+	while (newcap < len + n)
+		newcap *= 2;
+	q = realloc(*p, newcap * size);
+	if (q == NULL)
+		return false;
+	*p = q;
+	*cap = newcap;
+	return true;
+}
+
+bool lmpd_ioresult_starts_entity(const char *name)
+{
+	return strcmp(name, "file") == 0 || strcmp(name, "directory") == 0
+		|| strcmp(name, "playlist") == 0;
+}
+
+/* Appends a pair, false when out of memory */
+bool lmpd_ioresult_add_pair(struct lmpd_ioresult *res, const char *name, const char *value)
+{
+	void *p;
+	size_t cap, nlen, vlen;
+	uint32_t *pair;
+
+	nlen = strlen(name);
+	vlen = strlen(value);
+	if (res->text_len + nlen + vlen + 2 > UINT32_MAX)
+		return false;
+
+	if (!ioresult_reserve((void **) &res->text, &res->text_size, res->text_len,
+				nlen + vlen + 2, 1))
+		return false;
+
+	p = res->pairs;
+	cap = res->pairs_size;
+	if (!ioresult_reserve(&p, &cap, res->npairs * 4, 4, sizeof(uint32_t)))
+		return false;
+	res->pairs = p;
+	res->pairs_size = cap;
+
+	if (lmpd_ioresult_starts_entity(name)) {
+		p = res->starts;
+		cap = res->starts_size;
+		if (!ioresult_reserve(&p, &cap, res->nentities, 1, sizeof(uint32_t)))
+			return false;
+		res->starts = p;
+		res->starts_size = cap;
+		res->starts[res->nentities++] = res->npairs;
+	}
+
+	pair = res->pairs + res->npairs * 4;
+	pair[0] = res->text_len;
+	pair[1] = nlen;
+	memcpy(res->text + res->text_len, name, nlen + 1);
+	res->text_len += nlen + 1;
+	pair[2] = res->text_len;
+	pair[3] = vlen;
+	memcpy(res->text + res->text_len, value, vlen + 1);
+	res->text_len += vlen + 1;
+	res->npairs++;
+
+	return true;
+}
+
+/* Returns the connection of the engine, opening it when there is none or
+ * the last one broke. Sets the error of res on failure. */
+static struct mpd_connection *ioengine_connection(struct lmpd_ioengine *engine,
+		struct lmpd_ioresult *res)
+{
+	if (engine->conn != NULL
+			&& mpd_connection_get_error(engine->conn) != MPD_ERROR_SUCCESS) {
+		mpd_connection_free(engine->conn);
+		engine->conn = NULL;
+	}
+	if (engine->conn != NULL)
+		return engine->conn;
+
+	engine->conn = mpd_connection_new(engine->host, engine->port, engine->timeout);
+	if (engine->conn == NULL) {
+		lmpd_ioresult_fail(res, "out of memory");
+		return NULL;
+	}
+	if (mpd_connection_get_error(engine->conn) != MPD_ERROR_SUCCESS) {
+		lmpd_ioresult_fail(res, mpd_connection_get_error_message(engine->conn));
+		mpd_connection_free(engine->conn);
+		engine->conn = NULL;
+		return NULL;
+	}
+	return engine->conn;
+}
+
+/* Runs req on the I/O thread and fills in its result */
+static void ioengine_execute(struct lmpd_ioengine *engine, const struct lmpd_iorequest *req)
+{
+	bool oom;
+	struct mpd_pair *pair;
+	struct mpd_connection *conn;
+	struct lmpd_ioresult *res;
+
+	res = req->res;
+	conn = ioengine_connection(engine, res);
+	if (conn == NULL)
+		return;
+
+	if (!lmpd_send_argv(conn, req->name, req->argc, req->argv)) {
+		lmpd_ioresult_fail(res, mpd_connection_get_error_message(conn));
+		return;
+	}
+
+	/* Read the whole response even when the copy fails */
+	oom = false;
+	while ((pair = mpd_recv_pair(conn)) != NULL) {
+		if (!oom && !lmpd_ioresult_add_pair(res, pair->name, pair->value))
+			oom = true;
+		mpd_return_pair(conn, pair);
+	}
+
+	if (!mpd_response_finish(conn)) {
+		lmpd_ioresult_fail(res, mpd_connection_get_error_message(conn));
+		if (mpd_connection_get_error(conn) == MPD_ERROR_SERVER)
+			mpd_connection_clear_error(conn);
+	}
+	else if (oom)
+		lmpd_ioresult_fail(res, "out of memory");
+}
+
+static void *ioengine_run(void *data)
+{
+	struct pollfd pfd;
+	struct lmpd_ioengine *engine;
+	struct lmpd_iorequest *req;
+	struct lmpd_ioresult *res;
+
+	engine = data;
+	pfd.fd = engine->wake.fds[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		while ((req = ioring_pop(&engine->submit)) != NULL) {
+			ioengine_execute(engine, req);
+			res = req->res;
+			free(req);
+			if (ioring_push(&engine->complete, res))
+				ionotify_signal(&engine->done);
+		}
+
+		if (__atomic_load_n(&engine->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+		ionotify_drain(&engine->wake);
+	}
+
+	if (engine->conn != NULL) {
+		mpd_connection_free(engine->conn);
+		engine->conn = NULL;
+	}
+	return NULL;
+}
+
+/* Stops the thread and frees everything the rings still hold */
+static void ioengine_close(struct lmpd_ioengine *engine)
+{
+	struct lmpd_iorequest *req;
+	struct lmpd_ioresult *res;
+
+	if (engine->running) {
+		__atomic_store_n(&engine->stop, true, __ATOMIC_SEQ_CST);
+		ionotify_signal(&engine->wake);
+		pthread_join(engine->thread, NULL);
+		engine->running = false;
+	}
+
+	while ((req = ioring_pop(&engine->submit)) != NULL) {
+		lmpd_ioresult_free(req->res);
+		free(req);
+	}
+	while ((res = ioring_pop(&engine->complete)) != NULL)
+		lmpd_ioresult_free(res);
+	engine->inflight = 0;
+
+	ionotify_close(&engine->wake);
+	ionotify_close(&engine->done);
+	free(engine->host);
+	engine->host = NULL;
+}
+
+static int lmpdioengine_new(lua_State *L)
+{
+	int ret;
+	const char *host;
+	struct lmpd_ioengine *engine;
+
+	host = luaL_checkstring(L, 1);
+
+	engine = (struct lmpd_ioengine *) lua_newuserdata(L, sizeof(struct lmpd_ioengine));
+	engine->host = NULL;
+	engine->port = luaL_checkinteger(L, 2);
+	engine->timeout = luaL_checknumber(L, 3);
+	engine->running = false;
+	engine->stop = false;
+	engine->conn = NULL;
+	engine->next_id = 0;
+	engine->inflight = 0;
+	engine->wake.fds[0] = engine->wake.fds[1] = -1;
+	engine->done.fds[0] = engine->done.fds[1] = -1;
+	ioring_init(&engine->submit);
+	ioring_init(&engine->complete);
+	luaL_getmetatable(L, MPD_IOENGINE_T);
+	lua_setmetatable(L, -2);
+
+	engine->host = strdup(host);
+	if (engine->host == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	if (!ionotify_open(&engine->wake) || !ionotify_open(&engine->done)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	ret = pthread_create(&engine->thread, NULL, ioengine_run, engine);
+	if (ret != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(ret));
+		return 2;
+	}
+	engine->running = true;
+
+	return 1;
+}
+
+static int lmpdioengine_submit(lua_State *L)
+{
+	int i, argc;
+	size_t len, total;
+	char *p;
+	const char *name, *arg;
+	struct lmpd_ioengine *engine;
+	struct lmpd_iorequest *req;
+
+	engine = luaL_checkudata(L, 1, MPD_IOENGINE_T);
+	name = luaL_checklstring(L, 2, &total);
+	total++;
+
+	argc = lua_gettop(L) - 2;
+	if (argc > LMPD_ARGV_MAX)
+		return luaL_error(L, "too many arguments, at most %d are supported", LMPD_ARGV_MAX);
+	for (i = 0; i < argc; i++) {
+		luaL_checklstring(L, i + 3, &len);
+		total += len + 1;
+	}
+
+	if (!engine->running) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "engine is closed");
+		return 2;
+	}
+	if (engine->inflight >= LMPD_IORING_SIZE) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "too many commands in flight");
+		return 2;
+	}
+
+	req = malloc(sizeof(struct lmpd_iorequest) + total);
+	if (req == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	req->res = calloc(1, sizeof(struct lmpd_ioresult));
+	if (req->res == NULL) {
+		free(req);
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	req->res->id = ++engine->next_id;
+
+	p = req->data;
+	len = strlen(name) + 1;
+	memcpy(p, name, len);
+	req->name = p;
+	p += len;
+	req->argc = argc;
+	for (i = 0; i < argc; i++) {
+		arg = lua_tolstring(L, i + 3, &len);
+		memcpy(p, arg, len + 1);
+		req->argv[i] = p;
+		p += len + 1;
+	}
+
+	engine->inflight++;
+	lua_pushinteger(L, req->res->id);
+	if (ioring_push(&engine->submit, req))
+		ionotify_signal(&engine->wake);
+
+	return 1;
+}
+
+/* Sets the value of pair i in the table on top of the stack unless the
+ * entity has that name already, the first value is kept like in
+ * parse_response. */
+static void lmpdioresult_set_pair(lua_State *L, const struct lmpd_ioresult *res, unsigned i)
+{
+	const uint32_t *pair;
+
+	pair = res->pairs + i * 4;
+	lua_pushlstring(L, res->text + pair[0], pair[1]);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushlstring(L, res->text + pair[2], pair[3]);
+		lua_rawset(L, -3);
+	}
+	else
+		lua_pop(L, 2);
+}
+
+/* Pushes an array with a table for each entity of res */
+void lmpd_ioresult_push_entities(lua_State *L, const struct lmpd_ioresult *res)
+{
+	unsigned e, i, end;
+
+	lua_createtable(L, res->nentities, 0);
+	for (e = 0; e < res->nentities; e++) {
+		end = e + 1 < res->nentities ? res->starts[e + 1] : res->npairs;
+		lua_createtable(L, 0, end - res->starts[e]);
+		for (i = res->starts[e]; i < end; i++)
+			lmpdioresult_set_pair(L, res, i);
+		lua_rawseti(L, -2, e + 1);
+	}
+}
+
+/* Pushes a table of the pairs ahead of the first entity of res */
+void lmpd_ioresult_push_pairs(lua_State *L, const struct lmpd_ioresult *res)
+{
+	unsigned i, first;
+
+	first = res->nentities > 0 ? res->starts[0] : res->npairs;
+	lua_createtable(L, 0, first);
+	for (i = 0; i < first; i++)
+		lmpdioresult_set_pair(L, res, i);
+}
+
+/* Pushes { id, ok, error } for a failed command and { id, ok, pairs,
+ * entities } otherwise. pairs holds the lines ahead of the first "file",
+ * "directory" or "playlist" line, entities a table for each of those. */
+static void lmpdioengine_push_result(lua_State *L, const struct lmpd_ioresult *res)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, res->id);
+	lua_setfield(L, -2, "id");
+	lua_pushboolean(L, !res->failed);
+	lua_setfield(L, -2, "ok");
+
+	if (res->failed) {
+		lua_pushstring(L, res->error);
+		lua_setfield(L, -2, "error");
+		return;
+	}
+
+	lmpd_ioresult_push_pairs(L, res);
+	lua_setfield(L, -2, "pairs");
+
+	lmpd_ioresult_push_entities(L, res);
+	lua_setfield(L, -2, "entities");
+}
+
+/* Pushes an array of the finished results, returns their number */
+static int lmpdioengine_collect(lua_State *L, struct lmpd_ioengine *engine)
+{
+	int n;
+	struct lmpd_ioresult *res;
+
+	n = 0;
+	lua_newtable(L);
+	if (!engine->running)
+		return 0;
+
+	ionotify_drain(&engine->done);
+	while ((res = ioring_pop(&engine->complete)) != NULL) {
+		lmpdioengine_push_result(L, res);
+		lua_rawseti(L, -2, ++n);
+		engine->inflight--;
+		lmpd_ioresult_free(res);
+	}
+	return n;
+}
+
+static int lmpdioengine_poll(lua_State *L)
+{
+	struct lmpd_ioengine *engine;
+
+	engine = luaL_checkudata(L, 1, MPD_IOENGINE_T);
+
+	lmpdioengine_collect(L, engine);
+	return 1;
+}
+
+/* engine:wait([timeout]) returns the finished results, blocking for at most
+ * timeout seconds until there is one when commands are in flight */
+static int lmpdioengine_wait(lua_State *L)
+{
+	int ms;
+	double timeout;
+	struct pollfd pfd;
+	struct lmpd_ioengine *engine;
+
+	engine = luaL_checkudata(L, 1, MPD_IOENGINE_T);
+	timeout = luaL_optnumber(L, 2, -1);
+
+	if (lmpdioengine_collect(L, engine) > 0 || engine->inflight == 0)
+		return 1;
+	lua_pop(L, 1);
+
+	ms = timeout < 0 ? -1 : (int) (timeout * 1000);
+	pfd.fd = engine->done.fds[0];
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, ms) < 0 && errno == EINTR)
+		;
+
+	lmpdioengine_collect(L, engine);
+	return 1;
+}
+
+static int lmpdioengine_close(lua_State *L)
+{
+	struct lmpd_ioengine *engine;
+
+	engine = luaL_checkudata(L, 1, MPD_IOENGINE_T);
+
+	ioengine_close(engine);
+	return 0;
+}
+
+static int lmpdioengine_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_ioengine *engine;
+
+	engine = luaL_checkudata(L, 1, MPD_IOENGINE_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "submit", 7) == 0)
+		lua_pushcfunction(L, lmpdioengine_submit);
+	else if (strncmp(key, "poll", 5) == 0)
+		lua_pushcfunction(L, lmpdioengine_poll);
+	else if (strncmp(key, "wait", 5) == 0)
+		lua_pushcfunction(L, lmpdioengine_wait);
+	else if (strncmp(key, "close", 6) == 0)
+		lua_pushcfunction(L, lmpdioengine_close);
+	else if (strncmp(key, "fd", 3) == 0)
+		lua_pushinteger(L, engine->done.fds[0]);
+	else if (strncmp(key, "pending", 8) == 0)
+		lua_pushinteger(L, engine->inflight);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+
+	return 1;
+}
+
+static const luaL_reg lreg_ioengine[] = {
+	{"__index",	lmpdioengine_index},
+	{"__gc",	lmpdioengine_close},
+	{NULL,		NULL},
+};
+
+void linit_ioengine(lua_State *L)
+{
+	/* Register MPD_IOENGINE_T metatable */
+	luaL_newmetatable(L, MPD_IOENGINE_T);
+	luaL_register(L, NULL, lreg_ioengine);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_io_engine");
+	lua_pushcfunction(L, lmpdioengine_new);
+	lua_settable(L, -3);
+}
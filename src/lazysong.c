@@ -0,0 +1,271 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Lazy songs:
+ * Listings fetched with lazy_list() keep the raw response block as one Lua
+ * string. Each song only remembers its slice of the block, fields are
+ * decoded when they are first read and memoised afterwards.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/tag.h>
+
+#include "globals.h"
+
+#define LMPD_LAZYSONG_MEMO	MPD_LAZYSONG_T ".memo"
+
+struct lmpd_lazysong {
+	const char *data;
+	size_t len;
+};
+
+static const char *const lazy_commands[] = {
+	"listallinfo", "lsinfo", "playlistinfo", "plchanges", NULL,
+};
+
+/* Finds the idx'th value of name in the slice of the song */
+static const char *lmpdlazy_find(const struct lmpd_lazysong *song,
+		const char *name, unsigned idx, size_t *vlen)
+{
+	size_t nlen;
+	const char *p, *end, *nl;
+
+	nlen = strlen(name);
+	end = song->data + song->len;
+	for (p = song->data; p < end; p = nl + 1) {
+		nl = lmpd_scan(p, end, '\n');
+		if (nl == NULL)
+			nl = end;
+
+		if ((size_t) (nl - p) >= nlen + 2
+				&& memcmp(p, name, nlen) == 0
+				&& p[nlen] == ':' && p[nlen + 1] == ' '
+				&& idx-- == 0) {
+			*vlen = nl - p - nlen - 2;
+			return p + nlen + 2;
+		}
+	}
+	return NULL;
+}
+
+/* Pushes the memo table of the song at index 1 */
+static void lmpdlazy_push_memo(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, LMPD_LAZYSONG_MEMO);
+	lua_pushvalue(L, 1);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+static int lmpdlazy_get_tag(lua_State *L)
+{
+	int type, idx;
+	size_t vlen;
+	const char *name, *value;
+	struct lmpd_lazysong *song;
+
+	song = luaL_checkudata(L, 1, MPD_LAZYSONG_T);
+	type = luaL_checkinteger(L, 2);
+	idx = luaL_optinteger(L, 3, 0);
+
+	name = mpd_tag_name(type);
+	if (name == NULL)
+		return luaL_argerror(L, 2, "invalid tag type");
+
+	value = lmpdlazy_find(song, name, idx, &vlen);
+	if (value == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushlstring(L, value, vlen);
+	return 1;
+}
+
+static int lmpdlazy_index(lua_State *L)
+{
+	int numeric;
+	size_t vlen;
+	const char *key, *name, *value;
+	struct lmpd_lazysong *song;
+
+	song = luaL_checkudata(L, 1, MPD_LAZYSONG_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "get_tag", 8) == 0) {
+		lua_pushcfunction(L, lmpdlazy_get_tag);
+		return 1;
+	}
+
+	lmpdlazy_push_memo(L);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 1);
+
+	/* Known fields map to protocol names, others are looked up as is */
+	numeric = 1;
+	if (strncmp(key, "uri", 4) == 0) {
+		name = "file";
+		numeric = 0;
+	}
+	else if (strncmp(key, "duration", 9) == 0)
+		name = "Time";
+	else if (strncmp(key, "pos", 4) == 0)
+		name = "Pos";
+	else if (strncmp(key, "id", 3) == 0)
+		name = "Id";
+	else {
+		name = key;
+		numeric = 0;
+	}
+
+	value = lmpdlazy_find(song, name, 0, &vlen);
+	if (value == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	if (numeric)
+		lua_pushinteger(L, strtol(value, NULL, 10));
+	else
+		lua_pushlstring(L, value, vlen);
+
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	return 1;
+}
+
+static int lmpdconn_lazy_list(lua_State *L)
+{
+	int ret, n;
+	size_t len, cmdlen;
+	const char *command, *arg, *cmd, *block, *p, *end, *nl;
+	struct lmpd_lazysong *song;
+
+	lmpdconn_check(L, 1);
+	command = lazy_commands[luaL_checkoption(L, 2, NULL, lazy_commands)];
+	arg = luaL_optstring(L, 3, NULL);
+	lua_settop(L, 3);
+
+	lmpd_push_command_line(L, command, arg);
+	cmd = lua_tolstring(L, -1, &cmdlen);
+
+	ret = lmpdconn_exchange(L, 1, cmd, cmdlen, &block, &len);
+	if (ret != 0)
+		return ret;
+
+	/* Shared environment of all songs, keeps the block alive */
+	lua_createtable(L, 0, 1);
+	lua_pushlstring(L, block, len);
+	block = lua_tostring(L, -1);
+	lua_setfield(L, -2, "block");
+
+	lua_newtable(L);
+	song = NULL;
+	n = 0;
+	end = block + len;
+	for (p = block; p < end; p = nl + 1) {
+		nl = lmpd_scan(p, end, '\n');
+		if (nl == NULL)
+			nl = end;
+
+		if (nl - p > 6 && memcmp(p, "file: ", 6) == 0) {
+			if (song != NULL)
+				song->len = p - song->data;
+
+			song = (struct lmpd_lazysong *) lua_newuserdata(L, sizeof(struct lmpd_lazysong));
+			song->data = p;
+			song->len = 0;
+			luaL_getmetatable(L, MPD_LAZYSONG_T);
+			lua_setmetatable(L, -2);
+			lua_pushvalue(L, -3);
+			lua_setfenv(L, -2);
+			lua_rawseti(L, -2, ++n);
+		}
+		else if (song != NULL
+				&& ((nl - p > 11 && memcmp(p, "directory: ", 11) == 0)
+				|| (nl - p > 10 && memcmp(p, "playlist: ", 10) == 0))) {
+			song->len = p - song->data;
+			song = NULL;
+		}
+	}
+	if (song != NULL)
+		song->len = end - song->data;
+
+	return 1;
+}
+
+static const luaL_reg lreg_lazysong[] = {
+	{"__index",	lmpdlazy_index},
+	{NULL,		NULL},
+};
+
+static const luaL_reg lreg_lazy[] = {
+	{"lazy_list",	lmpdconn_lazy_list},
+	{NULL,		NULL},
+};
+
+void linit_lazysong(lua_State *L)
+{
+	/* Register MPD_LAZYSONG_T metatable */
+	luaL_newmetatable(L, MPD_LAZYSONG_T);
+	luaL_register(L, NULL, lreg_lazysong);
+	lua_pop(L, 1);
+
+	/* Memoised fields, weakly keyed by song */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, LMPD_LAZYSONG_MEMO);
+
+	/* Add lazy listing methods to MPD_CONNECTION_T metatable */
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	luaL_register(L, NULL, lreg_lazy);
+	lua_pop(L, 1);
+}
@@ -0,0 +1,620 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Managed connection:
+ * A connection that looks after itself. A background thread pings the
+ * server whenever the connection has been quiet for the keepalive
+ * interval, so MPD never drops it for being idle. When the connection
+ * breaks, in the background or during a command, it is opened again with
+ * exponential backoff and the session is restored: the password is sent
+ * and the tag types are set up again, as given in the options or as last
+ * changed with the password and tagtypes commands. Read-only commands
+ * that failed because of the breakage are retried on the new connection.
+ *
+ * Commands and the keepalive thread share the connection under a mutex.
+ * Responses are returned as a table of pairs and an array of entities.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/pair.h>
+#include <mpd/password.h>
+#include <mpd/recv.h>
+#include <mpd/response.h>
+
+#include "globals.h"
+
+#define LMPD_MANAGED_KEEPALIVE		30.0
+#define LMPD_MANAGED_RETRIES		3
+#define LMPD_MANAGED_BACKOFF		0.1
+#define LMPD_MANAGED_MAX_BACKOFF	5.0
+
+/* Commands that only read, safe to send again after a breakage */
+static const char *const idempotent_commands[] = {
+	"channels", "commands", "config", "count", "currentsong",
+	"decoders", "find", "getfingerprint", "list", "listall",
+	"listallinfo", "listfiles", "listmounts", "listneighbors",
+	"listplaylist", "listplaylistinfo", "listplaylists", "lsinfo",
+	"notcommands", "outputs", "ping", "playlistfind", "playlistid",
+	"playlistinfo", "playlistsearch", "plchanges", "plchangesposid",
+	"readcomments", "replay_gain_status", "search", "stats",
+	"status", "urlhandlers", NULL,
+};
+
+struct lmpd_managed {
+	char *host;
+	int port;
+	unsigned timeout;
+	char *password;
+	/* "enable" followed by the tag names, replayed after "clear" when
+	 * not NULL */
+	const char **tagtypes;
+	int ntagtypes;
+	double keepalive;
+	unsigned retries;
+	double backoff, max_backoff;
+
+	bool initialized;
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* The fields below are guarded by lock */
+	struct mpd_connection *conn;
+	bool stop;
+	double last_used;
+	char error[LMPD_IOERROR_MAX];
+	unsigned reconnects, failures, retried, keepalives;
+	double reconnect_time;
+};
+
+static bool managed_idempotent(const char *name)
+{
+	int i;
+
+	for (i = 0; idempotent_commands[i] != NULL; i++) {
+		if (strcmp(idempotent_commands[i], name) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Waits until the monotonic time t or until the connection is closed. The
+ * lock must be held. */
+static void managed_wait_until(struct lmpd_managed *mc, double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) t;
+	ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+	while (!mc->stop && lmpd_monotonic() < t) {
+		if (pthread_cond_timedwait(&mc->cond, &mc->lock, &ts) != 0)
+			break;
+	}
+}
+
+/* Checks a freshly opened connection and restores the session on it.
+ * Returns false with the error copied when it is unusable. */
+static bool managed_setup(struct lmpd_managed *mc)
+{
+	static const char *const clear[] = { "clear" };
+	struct mpd_connection *conn;
+
+	conn = mc->conn;
+	if (conn == NULL) {
+		strcpy(mc->error, "out of memory");
+		return false;
+	}
+
+	if (mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS
+			&& (mc->password == NULL || mpd_run_password(conn, mc->password))
+			&& (mc->tagtypes == NULL
+				|| (lmpd_send_argv(conn, "tagtypes", 1, clear)
+					&& mpd_response_finish(conn)
+					&& (mc->ntagtypes == 0
+						|| (lmpd_send_argv(conn, "tagtypes", mc->ntagtypes + 1, mc->tagtypes)
+							&& mpd_response_finish(conn))))))
+		return true;
+
+	strncpy(mc->error, mpd_connection_get_error_message(conn), sizeof(mc->error) - 1);
+	mc->error[sizeof(mc->error) - 1] = '\0';
+	mpd_connection_free(conn);
+	mc->conn = NULL;
+	return false;
+}
+
+static bool managed_healthy(const struct lmpd_managed *mc)
+{
+	return mc->conn != NULL && mpd_connection_get_error(mc->conn) == MPD_ERROR_SUCCESS;
+}
+
+/* Opens the connection again, retrying with exponential backoff. The lock
+ * must be held, it is released while waiting between attempts. */
+static bool managed_reconnect(struct lmpd_managed *mc, bool initial)
+{
+	bool adopted;
+	unsigned attempt;
+	double start, delay;
+
+	start = lmpd_monotonic();
+	delay = mc->backoff;
+	adopted = false;
+	for (attempt = 0; ; attempt++) {
+		if (mc->conn != NULL)
+			mpd_connection_free(mc->conn);
+		mc->conn = mpd_connection_new(mc->host, mc->port, mc->timeout);
+		if (managed_setup(mc))
+			break;
+
+		if (!initial)
+			mc->failures++;
+		if (attempt >= mc->retries || mc->stop)
+			break;
+		managed_wait_until(mc, lmpd_monotonic() + delay);
+		/* The other thread may have reconnected meanwhile, it counted
+		 * the reconnect but not the time spent here */
+		if (managed_healthy(mc)) {
+			adopted = true;
+			break;
+		}
+		delay *= 2;
+		if (delay > mc->max_backoff)
+			delay = mc->max_backoff;
+	}
+
+	mc->last_used = lmpd_monotonic();
+	if (!initial) {
+		mc->reconnect_time += mc->last_used - start;
+		if (mc->conn != NULL && !adopted)
+			mc->reconnects++;
+	}
+	return mc->conn != NULL;
+}
+
+static void *managed_keepalive(void *data)
+{
+	struct lmpd_managed *mc;
+
+	mc = data;
+	pthread_mutex_lock(&mc->lock);
+	while (!mc->stop) {
+		if (lmpd_monotonic() < mc->last_used + mc->keepalive) {
+			managed_wait_until(mc, mc->last_used + mc->keepalive);
+			continue;
+		}
+
+		if (managed_healthy(mc)
+				&& lmpd_send_argv(mc->conn, "ping", 0, NULL)
+				&& mpd_response_finish(mc->conn)) {
+			mc->keepalives++;
+			mc->last_used = lmpd_monotonic();
+		}
+		else
+			managed_reconnect(mc, false);
+	}
+	pthread_mutex_unlock(&mc->lock);
+
+	return NULL;
+}
+
+static void managed_free_tagtypes(struct lmpd_managed *mc)
+{
+	if (mc->tagtypes != NULL) {
+		/* tagtypes[0] is the literal "enable" */
+		for (; mc->ntagtypes > 0; mc->ntagtypes--)
+			free((char *) mc->tagtypes[mc->ntagtypes]);
+		free(mc->tagtypes);
+		mc->tagtypes = NULL;
+	}
+}
+
+/* Keeps the session changes made by a successful password or tagtypes
+ * command so they are restored after a reconnect, the lock must be held.
+ * The tag types are read back from the server, which knows the outcome
+ * of enable, disable, clear and all. */
+static void managed_record(struct lmpd_managed *mc, const char *name,
+		int argc, const char *const *argv)
+{
+	bool oom;
+	int n;
+	char *password;
+	const char **tagtypes;
+	struct mpd_pair *pair;
+
+	if (strcmp(name, "password") == 0 && argc == 1) {
+		password = strdup(argv[0]);
+		if (password != NULL) {
+			free(mc->password);
+			mc->password = password;
+		}
+		return;
+	}
+	if (strcmp(name, "tagtypes") != 0 || argc == 0)
+		return;
+
+	tagtypes = calloc(LMPD_ARGV_MAX, sizeof(char *));
+	if (tagtypes == NULL || !lmpd_send_argv(mc->conn, "tagtypes", 0, NULL)) {
+		free(tagtypes);
+		return;
+	}
+	tagtypes[0] = "enable";
+	n = 0;
+	oom = false;
+	while ((pair = mpd_recv_pair_named(mc->conn, "tagtype")) != NULL) {
+		if (!oom && n + 1 < LMPD_ARGV_MAX) {
+			tagtypes[n + 1] = strdup(pair->value);
+			if (tagtypes[n + 1] == NULL)
+				oom = true;
+			else
+				n++;
+		}
+		mpd_return_pair(mc->conn, pair);
+	}
+
+	if (!mpd_response_finish(mc->conn) || oom) {
+		for (; n > 0; n--)
+			free((char *) tagtypes[n]);
+		free(tagtypes);
+		return;
+	}
+	managed_free_tagtypes(mc);
+	mc->tagtypes = tagtypes;
+	mc->ntagtypes = n;
+}
+
+/* Sends the command and reads its response into res, the lock must be held */
+static void managed_execute(struct lmpd_managed *mc, const char *name,
+		int argc, const char *const *argv, struct lmpd_ioresult *res)
+{
+	bool oom;
+	struct mpd_pair *pair;
+	struct mpd_connection *conn;
+
+	conn = mc->conn;
+	if (!lmpd_send_argv(conn, name, argc, argv)) {
+		lmpd_ioresult_fail(res, mpd_connection_get_error_message(conn));
+		return;
+	}
+
+	oom = false;
+	while ((pair = mpd_recv_pair(conn)) != NULL) {
+		if (!oom && !lmpd_ioresult_add_pair(res, pair->name, pair->value))
+			oom = true;
+		mpd_return_pair(conn, pair);
+	}
+
+	if (!mpd_response_finish(conn))
+		lmpd_ioresult_fail(res, mpd_connection_get_error_message(conn));
+	else if (oom)
+		lmpd_ioresult_fail(res, "out of memory");
+}
+
+static void managed_close(struct lmpd_managed *mc)
+{
+	if (mc->initialized) {
+		if (mc->running) {
+			pthread_mutex_lock(&mc->lock);
+			mc->stop = true;
+			pthread_cond_broadcast(&mc->cond);
+			pthread_mutex_unlock(&mc->lock);
+			pthread_join(mc->thread, NULL);
+			mc->running = false;
+		}
+		pthread_cond_destroy(&mc->cond);
+		pthread_mutex_destroy(&mc->lock);
+		mc->initialized = false;
+	}
+
+	if (mc->conn != NULL) {
+		mpd_connection_free(mc->conn);
+		mc->conn = NULL;
+	}
+	free(mc->host);
+	mc->host = NULL;
+	free(mc->password);
+	mc->password = NULL;
+	managed_free_tagtypes(mc);
+}
+
+static double lmpdmanaged_optfield(lua_State *L, int idx, const char *field, double def)
+{
+	double value;
+
+	if (lua_isnoneornil(L, idx))
+		return def;
+	lua_getfield(L, idx, field);
+	value = luaL_optnumber(L, -1, def);
+	lua_pop(L, 1);
+	luaL_argcheck(L, value >= 0, idx, "negative option");
+	return value;
+}
+
+/* mpdclient.new_managed(host, port, timeout[, options]) connects and
+ * returns a managed connection. options may hold password, tagtypes (an
+ * array of tag names), keepalive (seconds, zero disables it), retries,
+ * backoff and max_backoff (seconds). */
+static int lmpdmanaged_new(lua_State *L)
+{
+	int i, ret;
+	const char *host;
+	pthread_condattr_t attr;
+	struct lmpd_managed *mc;
+
+	host = luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 4))
+		luaL_checktype(L, 4, LUA_TTABLE);
+
+	mc = (struct lmpd_managed *) lua_newuserdata(L, sizeof(struct lmpd_managed));
+	memset(mc, 0, sizeof(struct lmpd_managed));
+	luaL_getmetatable(L, MPD_MANAGED_T);
+	lua_setmetatable(L, -2);
+
+	mc->port = luaL_checkinteger(L, 2);
+	mc->timeout = luaL_checknumber(L, 3);
+	mc->keepalive = lmpdmanaged_optfield(L, 4, "keepalive", LMPD_MANAGED_KEEPALIVE);
+	mc->retries = lmpdmanaged_optfield(L, 4, "retries", LMPD_MANAGED_RETRIES);
+	mc->backoff = lmpdmanaged_optfield(L, 4, "backoff", LMPD_MANAGED_BACKOFF);
+	mc->max_backoff = lmpdmanaged_optfield(L, 4, "max_backoff", LMPD_MANAGED_MAX_BACKOFF);
+
+	mc->host = strdup(host);
+	if (mc->host == NULL)
+		return luaL_error(L, "out of memory");
+
+	if (!lua_isnoneornil(L, 4)) {
+		lua_getfield(L, 4, "password");
+		if (!lua_isnil(L, -1)) {
+			mc->password = strdup(luaL_checkstring(L, -1));
+			if (mc->password == NULL)
+				return luaL_error(L, "out of memory");
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 4, "tagtypes");
+		if (!lua_isnil(L, -1)) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			luaL_argcheck(L, (int) lua_objlen(L, -1) < LMPD_ARGV_MAX, 4, "too many tag types");
+			mc->tagtypes = calloc(lua_objlen(L, -1) + 1, sizeof(char *));
+			if (mc->tagtypes == NULL)
+				return luaL_error(L, "out of memory");
+			mc->tagtypes[0] = "enable";
+			for (i = 1; i <= (int) lua_objlen(L, -1); i++) {
+				lua_rawgeti(L, -1, i);
+				mc->tagtypes[i] = strdup(luaL_checkstring(L, -1));
+				if (mc->tagtypes[i] == NULL)
+					return luaL_error(L, "out of memory");
+				mc->ntagtypes = i;
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	pthread_mutex_init(&mc->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mc->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	mc->initialized = true;
+
+	if (!managed_reconnect(mc, true)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mc->error);
+		return 2;
+	}
+
+	if (mc->keepalive > 0) {
+		ret = pthread_create(&mc->thread, NULL, managed_keepalive, mc);
+		if (ret != 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(ret));
+			return 2;
+		}
+		mc->running = true;
+	}
+
+	return 1;
+}
+
+/* mc:run(name, ...) returns the pairs ahead of the first entity and an
+ * array of the entities of the response, or nil and an error message */
+static int lmpdmanaged_run(lua_State *L)
+{
+	int i, argc;
+	unsigned attempt;
+	bool idempotent;
+	const char *name;
+	const char *argv[LMPD_ARGV_MAX];
+	char error[LMPD_IOERROR_MAX];
+	struct lmpd_managed *mc;
+	struct lmpd_ioresult *res;
+
+	mc = luaL_checkudata(L, 1, MPD_MANAGED_T);
+	name = luaL_checkstring(L, 2);
+	/* Responses are read as pairs, binary chunks would break them */
+	luaL_argcheck(L, strcmp(name, "albumart") != 0 && strcmp(name, "readpicture") != 0,
+			2, "binary responses are not supported");
+
+	argc = lua_gettop(L) - 2;
+	if (argc > LMPD_ARGV_MAX)
+		return luaL_error(L, "too many arguments, at most %d are supported", LMPD_ARGV_MAX);
+	for (i = 0; i < argc; i++)
+		argv[i] = luaL_checkstring(L, i + 3);
+
+	if (!mc->initialized) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "connection is closed");
+		return 2;
+	}
+
+	idempotent = managed_idempotent(name);
+	res = NULL;
+	error[0] = '\0';
+
+	pthread_mutex_lock(&mc->lock);
+	for (attempt = 0; ; attempt++) {
+		if (!managed_healthy(mc) && !managed_reconnect(mc, false)) {
+			strcpy(error, mc->error);
+			break;
+		}
+
+		res = calloc(1, sizeof(struct lmpd_ioresult));
+		if (res == NULL) {
+			strcpy(error, "out of memory");
+			break;
+		}
+		managed_execute(mc, name, argc, argv, res);
+		mc->last_used = lmpd_monotonic();
+		if (!res->failed)
+			break;
+
+		if (mpd_connection_get_error(mc->conn) == MPD_ERROR_SERVER) {
+			/* The server refused, sending it again would not help */
+			mpd_connection_clear_error(mc->conn);
+			break;
+		}
+		if (managed_healthy(mc)) {
+			/* Failed on this side, out of memory, the connection
+			 * is fine and retrying would not help either */
+			break;
+		}
+		if (!idempotent || attempt >= mc->retries)
+			break;
+
+		mc->retried++;
+		lmpd_ioresult_free(res);
+		res = NULL;
+	}
+	if (res != NULL && !res->failed)
+		managed_record(mc, name, argc, argv);
+	pthread_mutex_unlock(&mc->lock);
+
+	if (res == NULL) {
+		lua_pushnil(L);
+		lua_pushstring(L, error);
+		return 2;
+	}
+	if (res->failed) {
+		lua_pushnil(L);
+		lua_pushstring(L, res->error);
+		lmpd_ioresult_free(res);
+		return 2;
+	}
+
+	lmpd_ioresult_push_pairs(L, res);
+	lmpd_ioresult_push_entities(L, res);
+	lmpd_ioresult_free(res);
+	return 2;
+}
+
+static int lmpdmanaged_close(lua_State *L)
+{
+	struct lmpd_managed *mc;
+
+	mc = luaL_checkudata(L, 1, MPD_MANAGED_T);
+
+	managed_close(mc);
+	return 0;
+}
+
+static int lmpdmanaged_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_managed *mc;
+
+	mc = luaL_checkudata(L, 1, MPD_MANAGED_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "run", 4) == 0) {
+		lua_pushcfunction(L, lmpdmanaged_run);
+		return 1;
+	}
+	else if (strncmp(key, "close", 6) == 0) {
+		lua_pushcfunction(L, lmpdmanaged_close);
+		return 1;
+	}
+	else if (!mc->initialized) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	/* Counters and state, read under the lock */
+	pthread_mutex_lock(&mc->lock);
+	if (strncmp(key, "connected", 10) == 0)
+		lua_pushboolean(L, managed_healthy(mc));
+	else if (strncmp(key, "reconnects", 11) == 0)
+		lua_pushinteger(L, mc->reconnects);
+	else if (strncmp(key, "reconnect_failures", 19) == 0)
+		lua_pushinteger(L, mc->failures);
+	else if (strncmp(key, "reconnect_time", 15) == 0)
+		lua_pushnumber(L, mc->reconnect_time);
+	else if (strncmp(key, "retried", 8) == 0)
+		lua_pushinteger(L, mc->retried);
+	else if (strncmp(key, "keepalives", 11) == 0)
+		lua_pushinteger(L, mc->keepalives);
+	else {
+		pthread_mutex_unlock(&mc->lock);
+		return luaL_error(L, "Invalid key `%s'", key);
+	}
+	pthread_mutex_unlock(&mc->lock);
+
+	return 1;
+}
+
+static const luaL_reg lreg_managed[] = {
+	{"__index",	lmpdmanaged_index},
+	{"__gc",	lmpdmanaged_close},
+	{NULL,		NULL},
+};
+
+void linit_managed(lua_State *L)
+{
+	/* Register MPD_MANAGED_T metatable */
+	luaL_newmetatable(L, MPD_MANAGED_T);
+	luaL_register(L, NULL, lreg_managed);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_managed");
+	lua_pushcfunction(L, lmpdmanaged_new);
+	lua_settable(L, -3);
+}
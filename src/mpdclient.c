@@ -55,10 +55,7 @@ static int mpdclient_new(lua_State *L)
 	port = luaL_checkinteger(L, 2);
 	timeout = luaL_checknumber(L, 3);
 
-	conn = (struct mpd_connection **) lua_newuserdata(L, sizeof(struct mpd_connection *));
-	luaL_getmetatable(L, MPD_CONNECTION_T);
-	lua_setmetatable(L, -2);
-
+	conn = lmpdconn_newuserdata(L, timeout);
 	*conn = mpd_connection_new(host, port, timeout);
 	if (*conn == NULL) {
 		/* Push nil and error message */
@@ -81,17 +78,37 @@ LUALIB_API int luaopen_mpdclient(lua_State *L)
 	luaL_register(L, "mpdclient", reg_global);
 
 	linit_connection(L);
+	linit_coalesce(L);
+	linit_clock(L);
+	linit_crawl(L);
+	linit_dircache(L);
 	linit_directory(L);
+	linit_dual(L);
 	linit_entity(L);
 	linit_error(L);
+	linit_fanout(L);
+	linit_group(L);
 	linit_idle(L);
+	linit_ioengine(L);
+	linit_lazysong(L);
+	linit_managed(L);
 	linit_output(L);
 	linit_pair(L);
+	linit_parser(L);
 	linit_playlist(L);
+	linit_playsync(L);
+	linit_prefetch(L);
 	linit_protocol(L);
+	linit_queuecache(L);
+	linit_snapshot(L);
 	linit_song(L);
+	linit_songsearch(L);
+	linit_songstore(L);
+	linit_sort(L);
 	linit_stats(L);
 	linit_status(L);
+	linit_sync(L);
+	linit_update(L);
 
 	return 1;
 }
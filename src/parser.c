@@ -0,0 +1,458 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Fast listing parser:
+ * Sends listing commands directly on the socket, reads the whole response
+ * into a buffer that is reused between calls and splits it into entities
+ * without going through libmpdclient's per-line parser. Newlines and
+ * separators are located with SSE2/AVX2 when the compiler targets them.
+ *
+ * libmpdclient does not know about these exchanges, so they must only be
+ * used while the connection is not in idle mode and no other response is
+ * pending.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+
+#include "globals.h"
+
+#define LMPD_READ_SIZE	65536
+/* Buffers grown past this are released before the next exchange */
+#define LMPD_BUFFER_KEEP	(1 << 20)
+
+static const char *const fast_commands[] = {
+	"listallinfo", "lsinfo", "playlistinfo", "plchanges", NULL,
+};
+
+/* Returns a pointer to the first c in [p, end) or NULL */
+const char *lmpd_scan(const char *p, const char *end, int c)
+{
+#if defined(__AVX2__)
+	const __m256i needle = _mm256_set1_epi8((char) c);
+
+	while (end - p >= 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *) p);
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i needle = _mm_set1_epi8((char) c);
+
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == (char) c)
+			return p;
+	}
+	return NULL;
+}
+
+static int lmpdbuffer_gc(lua_State *L)
+{
+	struct lmpd_buffer *buf;
+
+	buf = luaL_checkudata(L, 1, MPD_BUFFER_T);
+
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+
+	return 0;
+}
+
+/* Returns the buffer of the connection at index idx, creating it on first use */
+struct lmpd_buffer *lmpdconn_buffer(lua_State *L, int idx)
+{
+	struct lmpd_buffer *buf;
+
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "buffer");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		buf = (struct lmpd_buffer *) lua_newuserdata(L, sizeof(struct lmpd_buffer));
+		buf->data = NULL;
+		buf->len = buf->size = 0;
+		luaL_getmetatable(L, MPD_BUFFER_T);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, "buffer");
+	}
+	else
+		buf = lua_touserdata(L, -1);
+	lua_pop(L, 2);
+
+	return buf;
+}
+
+static int lmpd_wait(int fd, short events, int timeout)
+{
+	int ret;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/* Whether err only says the operation would have blocked */
+bool lmpd_would_block(int err)
+{
+#if EAGAIN != EWOULDBLOCK
+	if (err == EWOULDBLOCK)
+		return true;
+#endif
+	return err == EAGAIN;
+}
+
+/* Cuts the connection on fd in both directions. Called when an exchange
+ * libmpdclient knows nothing about fails halfway: the server sees it
+ * closed, a thread blocked reading it wakes up and writes fail. Data
+ * already received may still be read, so connections go through
+ * lmpdconn_poison() wherever the Lua state is at hand. */
+void lmpd_poison(int fd)
+{
+	shutdown(fd, SHUT_RDWR);
+}
+
+static const char *lmpd_write_all(int fd, const char *data, size_t len, int timeout)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n > 0) {
+			data += n;
+			len -= n;
+		}
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && lmpd_would_block(errno)) {
+			if (lmpd_wait(fd, POLLOUT, timeout) <= 0)
+				return "timeout while sending the command";
+		}
+		else
+			return strerror(errno);
+	}
+	return NULL;
+}
+
+/* Checks whether buf holds a complete response, which is the case when its
+ * last line is "OK" or an "ACK" line. */
+int lmpd_response_complete(const struct lmpd_buffer *buf, size_t *last)
+{
+	size_t i;
+
+	if (buf->len == 0 || buf->data[buf->len - 1] != '\n')
+		return 0;
+
+	for (i = buf->len - 1; i > 0 && buf->data[i - 1] != '\n'; i--)
+		;
+	*last = i;
+
+	if (buf->len - i == 3 && memcmp(buf->data + i, "OK\n", 3) == 0)
+		return 1;
+	if (buf->len - i > 4 && memcmp(buf->data + i, "ACK ", 4) == 0)
+		return 1;
+	return 0;
+}
+
+/* Poisons the connection at idx and pushes nil and errmsg */
+static int lmpdconn_exchange_fail(lua_State *L, int idx, const char *errmsg)
+{
+	lmpdconn_poison(L, idx);
+
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, errmsg);
+	return 2;
+}
+
+/* Sends the command line cmd on the socket of the connection at index idx and
+ * reads the complete response. On success the body without the final "OK"
+ * line is stored in block and zero is returned, otherwise nil and an error
+ * message are pushed and two is returned. A failure once the command is on
+ * its way leaves the connection poisoned, as its stream is out of step. */
+int lmpdconn_exchange(lua_State *L, int idx, const char *cmd, size_t cmdlen,
+		const char **block, size_t *blocklen)
+{
+	int fd, timeout;
+	size_t last;
+	ssize_t n;
+	char *data;
+	const char *errmsg;
+	struct lmpd_buffer *buf;
+	struct mpd_connection **conn;
+
+	conn = lmpdconn_check(L, idx);
+
+	assert(*conn != NULL);
+
+	if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "timeout");
+	timeout = lua_tointeger(L, -1);
+	lua_pop(L, 2);
+	if (timeout <= 0)
+		timeout = -1;
+
+	buf = lmpdconn_buffer(L, idx);
+	buf->len = 0;
+	if (buf->size > LMPD_BUFFER_KEEP) {
+		/* Do not hold on to the largest listing ever seen */
+		free(buf->data);
+		buf->data = NULL;
+		buf->size = 0;
+	}
+	fd = mpd_connection_get_fd(*conn);
+
+	errmsg = lmpd_write_all(fd, cmd, cmdlen, timeout);
+	if (errmsg != NULL)
+		return lmpdconn_exchange_fail(L, idx, errmsg);
+
+	for (;;) {
+		if (buf->size - buf->len < LMPD_READ_SIZE) {
+			data = realloc(buf->data, buf->size * 2 + LMPD_READ_SIZE);
+			if (data == NULL)
+				return lmpdconn_exchange_fail(L, idx, "out of memory");
+			buf->data = data;
+			buf->size = buf->size * 2 + LMPD_READ_SIZE;
+		}
+
+		n = read(fd, buf->data + buf->len, buf->size - buf->len);
+		if (n > 0) {
+			buf->len += n;
+			if (lmpd_response_complete(buf, &last))
+				break;
+		}
+		else if (n == 0)
+			return lmpdconn_exchange_fail(L, idx, "connection closed by the server");
+		else if (errno == EINTR)
+			continue;
+		else if (lmpd_would_block(errno)) {
+			if (lmpd_wait(fd, POLLIN, timeout) <= 0)
+				return lmpdconn_exchange_fail(L, idx, "timeout while receiving the response");
+		}
+		else
+			return lmpdconn_exchange_fail(L, idx, strerror(errno));
+	}
+
+	if (buf->data[last] == 'A') {
+		lua_pushnil(L);
+		lua_pushlstring(L, buf->data + last + 4, buf->len - last - 5);
+		return 2;
+	}
+
+	*block = buf->data;
+	*blocklen = last;
+	return 0;
+}
+
+/* Pushes the command line for command with argc quoted arguments */
+void lmpd_push_command_argv(lua_State *L, const char *command, int argc, const char *const *argv)
+{
+	int i;
+	const char *arg;
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, command);
+	for (i = 0; i < argc; i++) {
+		luaL_addstring(&b, " \"");
+		for (arg = argv[i]; *arg != '\0'; arg++) {
+			if (*arg == '"' || *arg == '\\')
+				luaL_addchar(&b, '\\');
+			luaL_addchar(&b, *arg);
+		}
+		luaL_addchar(&b, '"');
+	}
+	luaL_addchar(&b, '\n');
+	luaL_pushresult(&b);
+}
+
+/* Pushes the command line for command with an optional quoted argument */
+void lmpd_push_command_line(lua_State *L, const char *command, const char *arg)
+{
+	lmpd_push_command_argv(L, command, arg != NULL ? 1 : 0, &arg);
+}
+
+/* Splits a response body into entity tables and pushes them as an array.
+ * Every "file", "directory" or "playlist" line starts a new table; when a
+ * name occurs more than once in an entity the first value is kept. */
+static int lmpd_push_entities(lua_State *L, const char *p, const char *end)
+{
+	int n;
+	size_t klen;
+	const char *nl, *colon;
+
+	lua_newtable(L);
+	n = 0;
+
+	for (; p < end; p = nl + 1) {
+		nl = lmpd_scan(p, end, '\n');
+		if (nl == NULL)
+			nl = end;
+
+		if (nl - p > 4 && memcmp(p, "ACK ", 4) == 0) {
+			/* Push nil and error message */
+			lua_pushnil(L);
+			lua_pushlstring(L, p + 4, nl - p - 4);
+			return 2;
+		}
+
+		colon = lmpd_scan(p, nl, ':');
+		if (colon == NULL || colon + 1 >= nl || colon[1] != ' ')
+			continue;
+		klen = colon - p;
+
+		if ((klen == 4 && memcmp(p, "file", 4) == 0)
+				|| (klen == 9 && memcmp(p, "directory", 9) == 0)
+				|| (klen == 8 && memcmp(p, "playlist", 8) == 0)) {
+			if (n > 0)
+				lua_pop(L, 1);
+			lua_createtable(L, 0, 8);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, ++n);
+		}
+		else if (n == 0)
+			continue;
+
+		lua_pushlstring(L, p, klen);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, -3);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushlstring(L, colon + 2, nl - colon - 2);
+			lua_rawset(L, -3);
+		}
+		else
+			lua_pop(L, 2);
+	}
+
+	if (n > 0)
+		lua_pop(L, 1);
+	return 1;
+}
+
+static int lmpdconn_fast_list(lua_State *L)
+{
+	int ret;
+	size_t len, cmdlen;
+	const char *command, *arg, *block, *cmd;
+
+	lmpdconn_check(L, 1);
+	command = fast_commands[luaL_checkoption(L, 2, NULL, fast_commands)];
+	arg = luaL_optstring(L, 3, NULL);
+
+	lmpd_push_command_line(L, command, arg);
+	cmd = lua_tolstring(L, -1, &cmdlen);
+
+	ret = lmpdconn_exchange(L, 1, cmd, cmdlen, &block, &len);
+	if (ret != 0)
+		return ret;
+
+	return lmpd_push_entities(L, block, block + len);
+}
+
+static int lmpd_parse_response(lua_State *L)
+{
+	size_t len;
+	const char *block;
+
+	block = luaL_checklstring(L, 1, &len);
+
+	return lmpd_push_entities(L, block, block + len);
+}
+
+static const luaL_reg lreg_buffer[] = {
+	{"__gc",	lmpdbuffer_gc},
+	{NULL,		NULL},
+};
+
+static const luaL_reg lreg_parser[] = {
+	{"fast_list",	lmpdconn_fast_list},
+	{NULL,		NULL},
+};
+
+void linit_parser(lua_State *L)
+{
+	/* Register MPD_BUFFER_T metatable */
+	luaL_newmetatable(L, MPD_BUFFER_T);
+	luaL_register(L, NULL, lreg_buffer);
+	lua_pop(L, 1);
+
+	/* Add fast listing methods to MPD_CONNECTION_T metatable */
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	luaL_register(L, NULL, lreg_parser);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "parse_response");
+	lua_pushcfunction(L, lmpd_parse_response);
+	lua_settable(L, -3);
+}
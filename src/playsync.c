@@ -0,0 +1,294 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Synchronized playback:
+ * Starts or seeks playback on several servers so that the commands arrive
+ * at the same moment. The round trip time of every connection is sampled
+ * with ping and smoothed like TCP does (RFC 6298). A command is then sent
+ * to the most distant server first and to each other one later by the
+ * difference of their estimated one way delays, taken as half the round
+ * trip. Sending is built on the fanout exchange, so a connection that
+ * times out during a ping or a command is shut down rather than left to
+ * take the late reply for the answer to its next command.
+ *
+ * Estimates older than a second are refreshed before a command is sent,
+ * calling ping() from the event loop keeps them current in between.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "globals.h"
+
+/* Smoothing gains of RFC 6298 */
+#define LMPD_PLAYSYNC_ALPHA	0.125
+#define LMPD_PLAYSYNC_BETA	0.25
+/* Estimates older than this are refreshed by run, seconds */
+#define LMPD_PLAYSYNC_MAX_AGE	1.0
+/* Head start for the first send, seconds */
+#define LMPD_PLAYSYNC_LEAD	0.001
+
+struct lmpd_rtt {
+	/* Smoothed round trip time and its mean deviation, seconds */
+	double srtt;
+	double rttvar;
+	unsigned samples;
+};
+
+struct lmpd_playsync {
+	int n;
+	double measured_at;
+	struct lmpd_rtt rtt[];
+};
+
+static void rtt_sample(struct lmpd_rtt *rtt, double r)
+{
+	double delta;
+
+	if (rtt->samples++ == 0) {
+		rtt->srtt = r;
+		rtt->rttvar = r / 2;
+		return;
+	}
+
+	delta = rtt->srtt - r;
+	if (delta < 0)
+		delta = -delta;
+	rtt->rttvar = (1 - LMPD_PLAYSYNC_BETA) * rtt->rttvar + LMPD_PLAYSYNC_BETA * delta;
+	rtt->srtt = (1 - LMPD_PLAYSYNC_ALPHA) * rtt->srtt + LMPD_PLAYSYNC_ALPHA * r;
+}
+
+/* Pings every member once and feeds the round trips into the estimates.
+ * Leaves the fanout scratch space on the stack. */
+static struct lmpd_fanout_member *playsync_ping(lua_State *L, struct lmpd_playsync *ps)
+{
+	int i;
+	struct lmpd_fanout_member *members, *m;
+
+	lua_getfenv(L, 1);
+	members = lmpd_fanout_prepare(L, lua_gettop(L), ps->n);
+	lmpd_fanout_exchange(L, lua_gettop(L) - 1, members, ps->n, "ping\n", 5);
+	lua_remove(L, -2);
+
+	for (i = 0; i < ps->n; i++) {
+		m = &members[i];
+		if (m->error == NULL && m->buf->data[m->last] == 'O')
+			rtt_sample(&ps->rtt[i], m->done_at - m->sent_at);
+	}
+	ps->measured_at = lmpd_monotonic();
+
+	return members;
+}
+
+/* mpdclient.new_play_sync(conns) synchronizes the connections of the array
+ * conns */
+static int lmpdplaysync_new(lua_State *L)
+{
+	int i, n;
+	struct lmpd_playsync *ps;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = lua_objlen(L, 1);
+
+	ps = (struct lmpd_playsync *) lua_newuserdata(L, sizeof(struct lmpd_playsync)
+			+ n * sizeof(struct lmpd_rtt));
+	ps->n = n;
+	ps->measured_at = 0;
+	for (i = 0; i < n; i++) {
+		ps->rtt[i].srtt = 0;
+		ps->rtt[i].rttvar = 0;
+		ps->rtt[i].samples = 0;
+	}
+	luaL_getmetatable(L, MPD_PLAYSYNC_T);
+	lua_setmetatable(L, -2);
+
+	/* The environment table holds the members */
+	lmpd_fanout_check_members(L, 1);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+/* Pushes an array of the smoothed round trips, or their deviations, with
+ * false for members without a sample */
+static void lmpdplaysync_push_rtt(lua_State *L, const struct lmpd_playsync *ps, bool deviation)
+{
+	int i;
+
+	lua_createtable(L, ps->n, 0);
+	for (i = 0; i < ps->n; i++) {
+		if (ps->rtt[i].samples == 0)
+			lua_pushboolean(L, 0);
+		else
+			lua_pushnumber(L, deviation ? ps->rtt[i].rttvar : ps->rtt[i].srtt);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/* ps:ping([rounds]) samples the round trips, rounds times in a row, and
+ * returns them with the error messages of the members that failed */
+static int lmpdplaysync_ping(lua_State *L)
+{
+	int i, rounds;
+	struct lmpd_playsync *ps;
+	struct lmpd_fanout_member *members;
+
+	ps = luaL_checkudata(L, 1, MPD_PLAYSYNC_T);
+	rounds = luaL_optinteger(L, 2, 1);
+	luaL_argcheck(L, rounds > 0, 2, "rounds must be positive");
+
+	members = NULL;
+	for (i = 0; i < rounds; i++) {
+		if (members != NULL)
+			lua_pop(L, 1);
+		members = playsync_ping(L, ps);
+	}
+
+	lmpdplaysync_push_rtt(L, ps, false);
+	lmpd_fanout_push_results(L, members, ps->n);
+	lua_remove(L, -2);
+	return 2;
+}
+
+/* ps:run(name, ...) sends the command so that it reaches all members at
+ * the same time. Returns the response pairs of each member or false, the
+ * error messages and the estimated residual skew in seconds: the spread of
+ * the predicted arrival times plus the largest round trip deviation. */
+static int lmpdplaysync_run(lua_State *L)
+{
+	int i;
+	size_t cmdlen;
+	double t0, owd, max_owd, arrival, first, last, max_rttvar;
+	const char *cmd;
+	struct lmpd_playsync *ps;
+	struct lmpd_fanout_member *members, *m;
+
+	ps = luaL_checkudata(L, 1, MPD_PLAYSYNC_T);
+	cmd = lmpd_fanout_check_command(L, 2, &cmdlen);
+
+	if (lmpd_monotonic() - ps->measured_at > LMPD_PLAYSYNC_MAX_AGE) {
+		playsync_ping(L, ps);
+		lua_pop(L, 1);
+	}
+
+	lua_getfenv(L, 1);
+	members = lmpd_fanout_prepare(L, lua_gettop(L), ps->n);
+
+	/* Members without an estimate are sent to last */
+	max_owd = 0;
+	for (i = 0; i < ps->n; i++) {
+		if (ps->rtt[i].samples > 0 && ps->rtt[i].srtt / 2 > max_owd)
+			max_owd = ps->rtt[i].srtt / 2;
+	}
+	t0 = lmpd_monotonic() + LMPD_PLAYSYNC_LEAD;
+	for (i = 0; i < ps->n; i++) {
+		owd = ps->rtt[i].samples > 0 ? ps->rtt[i].srtt / 2 : 0;
+		members[i].send_at = t0 + max_owd - owd;
+	}
+
+	lmpd_fanout_exchange(L, lua_gettop(L) - 1, members, ps->n, cmd, cmdlen);
+
+	first = last = max_rttvar = 0;
+	for (i = 0; i < ps->n; i++) {
+		m = &members[i];
+		if (!m->started || ps->rtt[i].samples == 0)
+			continue;
+		arrival = m->sent_at + ps->rtt[i].srtt / 2;
+		if (first <= 0 || arrival < first)
+			first = arrival;
+		if (arrival > last)
+			last = arrival;
+		if (ps->rtt[i].rttvar > max_rttvar)
+			max_rttvar = ps->rtt[i].rttvar;
+	}
+
+	lmpd_fanout_push_results(L, members, ps->n);
+	lua_pushnumber(L, last - first + max_rttvar);
+	return 3;
+}
+
+static int lmpdplaysync_len(lua_State *L)
+{
+	struct lmpd_playsync *ps;
+
+	ps = luaL_checkudata(L, 1, MPD_PLAYSYNC_T);
+
+	lua_pushinteger(L, ps->n);
+	return 1;
+}
+
+static int lmpdplaysync_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_playsync *ps;
+
+	ps = luaL_checkudata(L, 1, MPD_PLAYSYNC_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "ping", 5) == 0)
+		lua_pushcfunction(L, lmpdplaysync_ping);
+	else if (strncmp(key, "run", 4) == 0)
+		lua_pushcfunction(L, lmpdplaysync_run);
+	else if (strncmp(key, "rtt", 4) == 0)
+		lmpdplaysync_push_rtt(L, ps, false);
+	else if (strncmp(key, "deviation", 10) == 0)
+		lmpdplaysync_push_rtt(L, ps, true);
+	else if (strncmp(key, "count", 6) == 0)
+		lua_pushinteger(L, ps->n);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+
+	return 1;
+}
+
+static const luaL_reg lreg_playsync[] = {
+	{"__index",	lmpdplaysync_index},
+	{"__len",	lmpdplaysync_len},
+	{NULL,		NULL},
+};
+
+void linit_playsync(lua_State *L)
+{
+	/* Register MPD_PLAYSYNC_T metatable */
+	luaL_newmetatable(L, MPD_PLAYSYNC_T);
+	luaL_register(L, NULL, lreg_playsync);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_play_sync");
+	lua_pushcfunction(L, lmpdplaysync_new);
+	lua_settable(L, -3);
+}
@@ -0,0 +1,402 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Prefetch:
+ * Drains a pending response on a helper thread. After a listing command
+ * such as send_list_all_meta, conn:prefetch() starts a thread that reads
+ * and splits the response into chunks of entities while Lua turns the
+ * previous chunk into tables, so receiving and decoding overlap. The queue
+ * between them holds a few chunks, the thread stops reading when it is
+ * full.
+ *
+ * The connection belongs to the thread until next() has returned the last
+ * chunk or close() was called, its methods refuse to run meanwhile.
+ * Closing early stops the thread without reading the rest, which could
+ * take as long as the whole listing, so the connection is poisoned and
+ * only good for closing. Closing the connection stops the thread first.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/pair.h>
+#include <mpd/recv.h>
+#include <mpd/response.h>
+
+#include "globals.h"
+
+/* Chunks waiting for Lua at most */
+#define LMPD_PREFETCH_DEPTH	4
+#define LMPD_PREFETCH_CHUNK	512
+
+struct lmpd_prefetch {
+	struct mpd_connection *conn;
+	unsigned chunk;
+	pthread_t thread;
+	bool running;
+	bool initialized;
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	/* The fields below are guarded by lock */
+	struct lmpd_ioresult *queue[LMPD_PREFETCH_DEPTH];
+	unsigned head, count;
+	bool done, cancel, failed;
+	char error[LMPD_IOERROR_MAX];
+};
+
+/* Hands a chunk to Lua, waiting for room. Frees it and returns false when
+ * the prefetch was cancelled. */
+static bool prefetch_enqueue(struct lmpd_prefetch *pf, struct lmpd_ioresult *res)
+{
+	pthread_mutex_lock(&pf->lock);
+	while (pf->count == LMPD_PREFETCH_DEPTH && !pf->cancel)
+		pthread_cond_wait(&pf->not_full, &pf->lock);
+	if (pf->cancel) {
+		pthread_mutex_unlock(&pf->lock);
+		lmpd_ioresult_free(res);
+		return false;
+	}
+	pf->queue[(pf->head + pf->count) % LMPD_PREFETCH_DEPTH] = res;
+	pf->count++;
+	pthread_cond_signal(&pf->not_empty);
+	pthread_mutex_unlock(&pf->lock);
+	return true;
+}
+
+static void prefetch_finish(struct lmpd_prefetch *pf, const char *errmsg)
+{
+	pthread_mutex_lock(&pf->lock);
+	if (errmsg != NULL && !pf->failed) {
+		pf->failed = true;
+		strncpy(pf->error, errmsg, sizeof(pf->error) - 1);
+		pf->error[sizeof(pf->error) - 1] = '\0';
+	}
+	pf->done = true;
+	pthread_cond_signal(&pf->not_empty);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+static void *prefetch_run(void *data)
+{
+	bool discard, cancelled;
+	const char *errmsg;
+	struct mpd_pair *pair;
+	struct lmpd_ioresult *res;
+	struct lmpd_prefetch *pf;
+
+	pf = data;
+	errmsg = NULL;
+	cancelled = false;
+	res = calloc(1, sizeof(struct lmpd_ioresult));
+	discard = res == NULL;
+	if (discard)
+		errmsg = "out of memory";
+
+	while ((pair = mpd_recv_pair(pf->conn)) != NULL) {
+		if (!discard && res->nentities == pf->chunk
+				&& lmpd_ioresult_starts_entity(pair->name)) {
+			if (!prefetch_enqueue(pf, res)) {
+				/* The connection was cut, stop reading */
+				mpd_return_pair(pf->conn, pair);
+				res = NULL;
+				cancelled = true;
+				break;
+			}
+			res = calloc(1, sizeof(struct lmpd_ioresult));
+			if (res == NULL) {
+				discard = true;
+				errmsg = "out of memory";
+			}
+		}
+		if (!discard && !lmpd_ioresult_add_pair(res, pair->name, pair->value)) {
+			lmpd_ioresult_free(res);
+			res = NULL;
+			discard = true;
+			errmsg = "out of memory";
+		}
+		mpd_return_pair(pf->conn, pair);
+	}
+
+	if (!cancelled && !mpd_response_finish(pf->conn))
+		errmsg = mpd_connection_get_error_message(pf->conn);
+
+	if (res != NULL && res->nentities > 0)
+		prefetch_enqueue(pf, res);
+	else if (res != NULL)
+		lmpd_ioresult_free(res);
+
+	prefetch_finish(pf, errmsg);
+	return NULL;
+}
+
+/* Stops the thread, discarding whatever it has not delivered yet. A thread
+ * still reading is cut off by shutting the socket down, true is returned
+ * then as the connection is left halfway through the response. */
+static bool prefetch_close(struct lmpd_prefetch *pf)
+{
+	bool cut;
+
+	if (!pf->initialized)
+		return false;
+
+	cut = false;
+	if (pf->running) {
+		pthread_mutex_lock(&pf->lock);
+		pf->cancel = true;
+		cut = !pf->done;
+		pthread_cond_signal(&pf->not_full);
+		pthread_mutex_unlock(&pf->lock);
+		if (cut)
+			lmpd_poison(mpd_connection_get_fd(pf->conn));
+		pthread_join(pf->thread, NULL);
+		pf->running = false;
+	}
+
+	for (; pf->count > 0; pf->count--) {
+		lmpd_ioresult_free(pf->queue[pf->head]);
+		pf->head = (pf->head + 1) % LMPD_PREFETCH_DEPTH;
+	}
+
+	pthread_cond_destroy(&pf->not_full);
+	pthread_cond_destroy(&pf->not_empty);
+	pthread_mutex_destroy(&pf->lock);
+	pf->initialized = false;
+	return cut;
+}
+
+/* Ends the loan of the connection to the prefetch at idx */
+static void prefetch_release(lua_State *L, int idx)
+{
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "conn");
+	lua_getfenv(L, -1);
+	lua_getfield(L, -1, "prefetch");
+	if (lua_rawequal(L, -1, idx)) {
+		lua_pushnil(L);
+		lua_setfield(L, -3, "prefetch");
+	}
+	lua_pop(L, 4);
+}
+
+/* Stops the prefetch the connection at idx is lent to, if any */
+void lmpd_prefetch_cancel(lua_State *L, int idx)
+{
+	struct lmpd_prefetch *pf;
+
+	lua_getfenv(L, idx);
+	lua_getfield(L, -1, "prefetch");
+	pf = lua_touserdata(L, -1);
+	if (pf != NULL) {
+		prefetch_close(pf);
+		lua_pushnil(L);
+		lua_setfield(L, -3, "prefetch");
+	}
+	lua_pop(L, 2);
+}
+
+/* conn:prefetch([chunk]) receives the pending response in the background,
+ * next() returns up to chunk entities at a time */
+static int lmpdconn_prefetch(lua_State *L)
+{
+	int ret;
+	lua_Integer chunk;
+	struct mpd_connection **conn;
+	struct lmpd_prefetch *pf;
+
+	conn = lmpdconn_check(L, 1);
+	chunk = luaL_optinteger(L, 2, LMPD_PREFETCH_CHUNK);
+	luaL_argcheck(L, chunk > 0, 2, "chunk size must be positive");
+
+	assert(*conn != NULL);
+
+	pf = (struct lmpd_prefetch *) lua_newuserdata(L, sizeof(struct lmpd_prefetch));
+	pf->conn = *conn;
+	pf->chunk = chunk;
+	pf->running = false;
+	pf->initialized = false;
+	pf->head = 0;
+	pf->count = 0;
+	pf->done = false;
+	pf->cancel = false;
+	pf->failed = false;
+	pf->error[0] = '\0';
+	luaL_getmetatable(L, MPD_PREFETCH_T);
+	lua_setmetatable(L, -2);
+
+	/* The environment table keeps the connection alive */
+	lua_createtable(L, 0, 1);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "conn");
+	lua_setfenv(L, -2);
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->not_empty, NULL);
+	pthread_cond_init(&pf->not_full, NULL);
+	pf->initialized = true;
+
+	ret = pthread_create(&pf->thread, NULL, prefetch_run, pf);
+	if (ret != 0) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(ret));
+		return 2;
+	}
+	pf->running = true;
+
+	/* Lent until the last chunk or close() */
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, "prefetch");
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+/* prefetch:next() returns an array of entity tables, nil after the last
+ * one, or nil and an error message when the response failed */
+static int lmpdprefetch_next(lua_State *L)
+{
+	struct lmpd_ioresult *res;
+	struct lmpd_prefetch *pf;
+
+	pf = luaL_checkudata(L, 1, MPD_PREFETCH_T);
+
+	if (!pf->running) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	while (pf->count == 0 && !pf->done)
+		pthread_cond_wait(&pf->not_empty, &pf->lock);
+	res = NULL;
+	if (pf->count > 0) {
+		res = pf->queue[pf->head];
+		pf->head = (pf->head + 1) % LMPD_PREFETCH_DEPTH;
+		pf->count--;
+		pthread_cond_signal(&pf->not_full);
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	if (res != NULL) {
+		lmpd_ioresult_push_entities(L, res);
+		lmpd_ioresult_free(res);
+		return 1;
+	}
+
+	/* Done and drained, the connection is ours again */
+	pthread_join(pf->thread, NULL);
+	pf->running = false;
+	prefetch_release(L, 1);
+
+	if (pf->failed) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, pf->error);
+		return 2;
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int lmpdprefetch_close(lua_State *L)
+{
+	struct lmpd_prefetch *pf;
+
+	pf = luaL_checkudata(L, 1, MPD_PREFETCH_T);
+
+	if (prefetch_close(pf)) {
+		/* Left halfway through the response */
+		lua_getfenv(L, 1);
+		lua_getfield(L, -1, "conn");
+		lmpdconn_poison(L, lua_gettop(L));
+		lua_pop(L, 2);
+	}
+	prefetch_release(L, 1);
+	return 0;
+}
+
+static int lmpdprefetch_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_prefetch *pf;
+
+	pf = luaL_checkudata(L, 1, MPD_PREFETCH_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "next", 5) == 0)
+		lua_pushcfunction(L, lmpdprefetch_next);
+	else if (strncmp(key, "close", 6) == 0)
+		lua_pushcfunction(L, lmpdprefetch_close);
+	else if (strncmp(key, "chunk", 6) == 0)
+		lua_pushinteger(L, pf->chunk);
+	else if (strncmp(key, "done", 5) == 0)
+		lua_pushboolean(L, !pf->running);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+
+	return 1;
+}
+
+static const luaL_reg lreg_prefetch[] = {
+	{"__index",	lmpdprefetch_index},
+	{"__gc",	lmpdprefetch_close},
+	{NULL,		NULL},
+};
+
+static const luaL_reg lreg_conn_prefetch[] = {
+	{"prefetch",	lmpdconn_prefetch},
+	{NULL,		NULL},
+};
+
+void linit_prefetch(lua_State *L)
+{
+	/* Register MPD_PREFETCH_T metatable */
+	luaL_newmetatable(L, MPD_PREFETCH_T);
+	luaL_register(L, NULL, lreg_prefetch);
+	lua_pop(L, 1);
+
+	/* Add the prefetch method to MPD_CONNECTION_T metatable */
+	luaL_getmetatable(L, MPD_CONNECTION_T);
+	luaL_register(L, NULL, lreg_conn_prefetch);
+	lua_pop(L, 1);
+}
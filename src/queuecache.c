@@ -0,0 +1,320 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Queue cache:
+ * Keeps recently fetched windows of the queue for virtual scrolling. The
+ * queue is split into fixed size windows which are fetched with ranged
+ * playlistinfo, together with the adjacent window in scroll direction, in
+ * one command list. Windows are evicted least recently used first and the
+ * whole cache is dropped when the queue version changes.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/list.h>
+#include <mpd/response.h>
+#include <mpd/status.h>
+
+#include "globals.h"
+
+struct lmpd_queuecache {
+	unsigned window;
+	unsigned capacity;
+	unsigned count;
+	unsigned version;
+	bool valid;
+	int last_first;
+	double tick;
+};
+
+static int lmpdqueuecache_new(lua_State *L)
+{
+	int window, capacity;
+	struct lmpd_queuecache *cache;
+
+	window = luaL_optinteger(L, 1, 100);
+	capacity = luaL_optinteger(L, 2, 16);
+
+	luaL_argcheck(L, window > 0, 1, "window must be positive");
+	luaL_argcheck(L, capacity > 0, 2, "capacity must be positive");
+
+	cache = (struct lmpd_queuecache *) lua_newuserdata(L, sizeof(struct lmpd_queuecache));
+	cache->window = window;
+	cache->capacity = capacity;
+	cache->count = 0;
+	cache->version = 0;
+	cache->valid = false;
+	cache->last_first = 0;
+	cache->tick = 0;
+	luaL_getmetatable(L, MPD_QUEUECACHE_T);
+	lua_setmetatable(L, -2);
+
+	/* windows maps window index to song arrays, stamps to last use */
+	lua_createtable(L, 0, 2);
+	lua_newtable(L);
+	lua_setfield(L, -2, "windows");
+	lua_newtable(L);
+	lua_setfield(L, -2, "stamps");
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+static void lmpdqueuecache_clear(lua_State *L, struct lmpd_queuecache *cache, int env)
+{
+	lua_newtable(L);
+	lua_setfield(L, env, "windows");
+	lua_newtable(L);
+	lua_setfield(L, env, "stamps");
+	cache->count = 0;
+}
+
+/* Evicts the least recently used windows until the cache fits */
+static void lmpdqueuecache_evict(lua_State *L, struct lmpd_queuecache *cache,
+		int windows, int stamps)
+{
+	lua_Number stamp, oldest;
+
+	while (cache->count > cache->capacity) {
+		/* Find the window with the oldest stamp, the victim */
+		lua_pushnil(L);
+		oldest = 0;
+		lua_pushnil(L);
+		while (lua_next(L, stamps) != 0) {
+			stamp = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+			if (lua_isnil(L, -2) || stamp < oldest) {
+				oldest = stamp;
+				lua_pushvalue(L, -1);
+				lua_replace(L, -3);
+			}
+		}
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, stamps);
+		lua_pushnil(L);
+		lua_rawset(L, windows);
+		cache->count--;
+	}
+}
+
+/* cache:get(conn, status, start, end) returns the songs at the queue
+ * positions [start, end), clamped to the queue length of status. */
+static int lmpdqueuecache_get(lua_State *L)
+{
+	int i, n, first, last, prefetch, nfetch;
+	unsigned start, end, length, version, lo, hi, pos;
+	int fetch[64];
+	struct lmpd_queuecache *cache;
+	struct mpd_connection **conn;
+	struct mpd_status **status;
+
+	cache = luaL_checkudata(L, 1, MPD_QUEUECACHE_T);
+	conn = lmpdconn_check(L, 2);
+	status = luaL_checkudata(L, 3, MPD_STATUS_T);
+	start = luaL_checkinteger(L, 4);
+	end = luaL_checkinteger(L, 5);
+	lua_settop(L, 5);
+
+	assert(*conn != NULL);
+	assert(*status != NULL);
+
+	/* env at 6, windows at 7, stamps at 8 */
+	lua_getfenv(L, 1);
+	version = mpd_status_get_queue_version(*status);
+	if (!cache->valid || cache->version != version) {
+		lmpdqueuecache_clear(L, cache, 6);
+		cache->version = version;
+		cache->valid = true;
+	}
+	lua_getfield(L, 6, "windows");
+	lua_getfield(L, 6, "stamps");
+
+	length = mpd_status_get_queue_length(*status);
+	if (end > length)
+		end = length;
+	if (start >= end) {
+		lua_newtable(L);
+		return 1;
+	}
+
+	first = start / cache->window;
+	last = (end - 1) / cache->window;
+	luaL_argcheck(L, last - first < 62, 5, "range spans too many windows");
+
+	/* Prefetch the neighbour in scroll direction if it exists */
+	if (first < cache->last_first)
+		prefetch = first - 1;
+	else
+		prefetch = last + 1;
+	if (prefetch < 0 || (unsigned) prefetch * cache->window >= length)
+		prefetch = -1;
+	cache->last_first = first;
+
+	nfetch = 0;
+	for (i = first; i <= last; i++) {
+		lua_rawgeti(L, 7, i);
+		if (lua_isnil(L, -1))
+			fetch[nfetch++] = i;
+		lua_pop(L, 1);
+	}
+	if (prefetch >= 0) {
+		lua_rawgeti(L, 7, prefetch);
+		if (lua_isnil(L, -1))
+			fetch[nfetch++] = prefetch;
+		lua_pop(L, 1);
+	}
+
+	if (nfetch > 0) {
+		if (!mpd_command_list_begin(*conn, true))
+			goto fail;
+		for (i = 0; i < nfetch; i++) {
+			lo = (unsigned) fetch[i] * cache->window;
+			hi = lo + cache->window < length ? lo + cache->window : length;
+			if (!lmpd_send_queue_range(*conn, lo, hi))
+				goto fail;
+		}
+		if (!mpd_command_list_end(*conn))
+			goto fail;
+
+		for (i = 0; i < nfetch; i++) {
+			lmpd_push_songs(L, *conn);
+			if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS)
+				goto fail;
+			lua_rawseti(L, 7, fetch[i]);
+			cache->count++;
+			if (i + 1 < nfetch && !mpd_response_next(*conn))
+				goto fail;
+		}
+		if (!mpd_response_finish(*conn))
+			goto fail;
+	}
+
+	/* Touch the windows in use, the prefetched one counts as older */
+	if (prefetch >= 0) {
+		lua_pushnumber(L, ++cache->tick);
+		lua_rawseti(L, 8, prefetch);
+	}
+	for (i = first; i <= last; i++) {
+		lua_pushnumber(L, ++cache->tick);
+		lua_rawseti(L, 8, i);
+	}
+
+	/* Assemble the result */
+	lua_createtable(L, end - start, 0);
+	n = 0;
+	for (i = first; i <= last; i++) {
+		lua_rawgeti(L, 7, i);
+		lo = (unsigned) i * cache->window;
+		hi = lo + cache->window;
+		for (pos = (start > lo ? start : lo); pos < end && pos < hi; pos++) {
+			lua_rawgeti(L, -1, pos - lo + 1);
+			lua_rawseti(L, -3, ++n);
+		}
+		lua_pop(L, 1);
+	}
+
+	lmpdqueuecache_evict(L, cache, 7, 8);
+	return 1;
+
+fail:
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, mpd_connection_get_error_message(*conn));
+	return 2;
+}
+
+static int lmpdqueuecache_clear_l(lua_State *L)
+{
+	struct lmpd_queuecache *cache;
+
+	cache = luaL_checkudata(L, 1, MPD_QUEUECACHE_T);
+
+	lua_getfenv(L, 1);
+	lmpdqueuecache_clear(L, cache, lua_gettop(L));
+	cache->valid = false;
+	return 0;
+}
+
+static int lmpdqueuecache_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_queuecache *cache;
+
+	cache = luaL_checkudata(L, 1, MPD_QUEUECACHE_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "get", 4) == 0)
+		lua_pushcfunction(L, lmpdqueuecache_get);
+	else if (strncmp(key, "clear", 6) == 0)
+		lua_pushcfunction(L, lmpdqueuecache_clear_l);
+	else if (strncmp(key, "window", 7) == 0)
+		lua_pushinteger(L, cache->window);
+	else if (strncmp(key, "capacity", 9) == 0)
+		lua_pushinteger(L, cache->capacity);
+	else if (strncmp(key, "count", 6) == 0)
+		lua_pushinteger(L, cache->count);
+	else if (strncmp(key, "queue_version", 14) == 0)
+		lua_pushnumber(L, cache->version);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static const luaL_reg lreg_queuecache[] = {
+	{"__index",	lmpdqueuecache_index},
+	{NULL,		NULL},
+};
+
+void linit_queuecache(lua_State *L)
+{
+	/* Register MPD_QUEUECACHE_T metatable */
+	luaL_newmetatable(L, MPD_QUEUECACHE_T);
+	luaL_register(L, NULL, lreg_queuecache);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_queue_cache");
+	lua_pushcfunction(L, lmpdqueuecache_new);
+	lua_settable(L, -3);
+}
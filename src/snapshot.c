@@ -0,0 +1,215 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Snapshots:
+ * A process wide table of named, frozen song stores. A thread publishes
+ * a store once it is loaded and the Lua states of the other threads attach
+ * to it, sharing one copy of the library. Publishing again swaps the new
+ * store in under a lock; states still holding the old one keep it until
+ * they let go, reference counting frees it after the last one. Frozen
+ * stores are copied on modification, so a refresh loads into a new store,
+ * or a copy of the attached one, and publishes it.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "globals.h"
+
+#define LMPD_SNAPSHOTS_MAX	16
+#define LMPD_SNAPSHOT_NAME_MAX	64
+
+struct lmpd_snapshot {
+	char name[LMPD_SNAPSHOT_NAME_MAX];
+	struct lmpd_songstore *store;
+	/* Taken from snapshot_generation by every publish, so it never
+	 * repeats for a name withdrawn and published again */
+	unsigned generation;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lmpd_snapshot snapshots[LMPD_SNAPSHOTS_MAX];
+static unsigned snapshot_generation;
+
+/* Returns the slot called name, or a free one with create. The lock must
+ * be held. */
+static struct lmpd_snapshot *snapshot_find(const char *name, bool create)
+{
+	int i;
+	struct lmpd_snapshot *free_slot;
+
+	free_slot = NULL;
+	for (i = 0; i < LMPD_SNAPSHOTS_MAX; i++) {
+		if (snapshots[i].name[0] == '\0') {
+			if (free_slot == NULL)
+				free_slot = &snapshots[i];
+		}
+		else if (strcmp(snapshots[i].name, name) == 0)
+			return &snapshots[i];
+	}
+
+	if (!create || free_slot == NULL)
+		return NULL;
+	strcpy(free_slot->name, name);
+	return free_slot;
+}
+
+static const char *lmpdsnapshot_check_name(lua_State *L, int idx)
+{
+	size_t len;
+	const char *name;
+
+	name = luaL_checklstring(L, idx, &len);
+	luaL_argcheck(L, len > 0 && len < LMPD_SNAPSHOT_NAME_MAX, idx, "invalid snapshot name");
+	return name;
+}
+
+/* mpdclient.publish(name, store) freezes store and makes it the snapshot
+ * called name, nil withdraws the snapshot and frees its slot. Returns the
+ * new generation, zero after a withdrawal. */
+static int lmpdsnapshot_publish(lua_State *L)
+{
+	unsigned generation;
+	const char *name;
+	struct lmpd_songstore *store, *old;
+	struct lmpd_snapshot *snapshot;
+
+	name = lmpdsnapshot_check_name(L, 1);
+	store = lua_isnoneornil(L, 2) ? NULL : lmpd_songstore_check(L, 2);
+
+	if (store != NULL) {
+		store->frozen = true;
+		lmpd_songstore_ref(store);
+	}
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot = snapshot_find(name, store != NULL);
+	if (snapshot == NULL) {
+		pthread_mutex_unlock(&snapshot_lock);
+		if (store != NULL) {
+			lmpd_songstore_unref(store);
+			/* Push nil and error message */
+			lua_pushnil(L);
+			lua_pushliteral(L, "too many snapshots");
+			return 2;
+		}
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	old = snapshot->store;
+	snapshot->store = store;
+	if (store != NULL)
+		generation = snapshot->generation = ++snapshot_generation;
+	else {
+		snapshot->name[0] = '\0';
+		generation = snapshot->generation = 0;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (old != NULL)
+		lmpd_songstore_unref(old);
+
+	lua_pushinteger(L, generation);
+	return 1;
+}
+
+/* mpdclient.attach(name) returns the current snapshot called name as a
+ * song store and its generation, or nil when there is none. */
+static int lmpdsnapshot_attach(lua_State *L)
+{
+	unsigned generation;
+	const char *name;
+	struct lmpd_songstore *store;
+	struct lmpd_snapshot *snapshot;
+
+	name = lmpdsnapshot_check_name(L, 1);
+
+	store = NULL;
+	generation = 0;
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot = snapshot_find(name, false);
+	if (snapshot != NULL && snapshot->store != NULL) {
+		store = snapshot->store;
+		lmpd_songstore_ref(store);
+		generation = snapshot->generation;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (store == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lmpd_songstore_push(L, store);
+	lua_pushinteger(L, generation);
+	return 2;
+}
+
+/* mpdclient.snapshot_generation(name) tells whether attached stores are
+ * outdated without attaching, zero when nothing was published */
+static int lmpdsnapshot_generation(lua_State *L)
+{
+	unsigned generation;
+	const char *name;
+	struct lmpd_snapshot *snapshot;
+
+	name = lmpdsnapshot_check_name(L, 1);
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot = snapshot_find(name, false);
+	generation = snapshot != NULL ? snapshot->generation : 0;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	lua_pushinteger(L, generation);
+	return 1;
+}
+
+void linit_snapshot(lua_State *L)
+{
+	lua_pushliteral(L, "publish");
+	lua_pushcfunction(L, lmpdsnapshot_publish);
+	lua_settable(L, -3);
+
+	lua_pushliteral(L, "attach");
+	lua_pushcfunction(L, lmpdsnapshot_attach);
+	lua_settable(L, -3);
+
+	lua_pushliteral(L, "snapshot_generation");
+	lua_pushcfunction(L, lmpdsnapshot_generation);
+	lua_settable(L, -3);
+}
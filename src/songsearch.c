@@ -0,0 +1,638 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Song search:
+ * Search as you type over a song store. Tag values are interned, so each
+ * distinct string is matched once per query and rows are scored by looking
+ * up the scores of their fields. The strings of the searched fields are
+ * copied, with ASCII case folded, into one packed text which is scanned in
+ * memory order. A substring match is tried first, then a subsequence match
+ * with a lower score. When a query extends the previous one only the
+ * previous matches are tested again. The best k rows are kept in a heap.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/tag.h>
+
+#include "globals.h"
+
+#define LMPD_SEARCH_FIELDS	8
+/* The uri is searched as a field of its own */
+#define LMPD_SEARCH_URI		(-1)
+/* Vector loads may run this far past the end of the packed text */
+#define LMPD_SEARCH_SLACK	32
+
+struct lmpd_songsearch {
+	int fields[LMPD_SEARCH_FIELDS];
+	int nfields;
+
+	/* The store the state below was built for */
+	const struct lmpd_songstore *store;
+	unsigned store_rows;
+	uint32_t store_strings;
+
+	/* Distinct strings of the fields by index: store id, offset into the
+	 * folded text and the set of characters occurring, see
+	 * search_charbit(). */
+	uint32_t nstrings;
+	uint32_t *ids;
+	uint32_t *offsets;
+	uint64_t *charsets;
+	char *text;
+	/* Score by store id, nonzero for the matches of the last query */
+	int32_t *scores;
+
+	/* Matches of the last query, for refinement */
+	char *last;
+	bool last_fuzzy;
+	uint32_t *matched_strings;
+	uint32_t nmatched_strings;
+	unsigned *matched_rows;
+	unsigned nmatched_rows;
+};
+
+struct lmpd_hit {
+	int32_t score;
+	unsigned row;
+};
+
+static inline unsigned char search_fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* Bit of the folded c in the character set masks */
+static inline uint64_t search_charbit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return UINT64_C(1) << (c - 'a');
+	if (c >= '0' && c <= '9')
+		return UINT64_C(1) << (26 + c - '0');
+	return UINT64_C(1) << (36 + c % 28);
+}
+
+static uint64_t search_charset(const char *s, size_t len)
+{
+	size_t i;
+	uint64_t set;
+
+	set = 0;
+	for (i = 0; i < len; i++)
+		set |= search_charbit(s[i]);
+	return set;
+}
+
+/* Returns the first occurrence of q in s or NULL, both folded. The vector
+ * paths compare the first and the last byte of the query at every position
+ * and read up to a vector width past the end of s. */
+static const char *search_substring(const char *s, size_t len, const char *q, size_t qlen)
+{
+	size_t i;
+	unsigned j, mask, valid;
+
+	if (qlen > len)
+		return NULL;
+#if defined(__AVX2__)
+	const __m256i vfirst = _mm256_set1_epi8(q[0]);
+	const __m256i vlast = _mm256_set1_epi8(q[qlen - 1]);
+
+	for (i = 0; i + qlen <= len; i += 32) {
+		__m256i first = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i last = _mm256_loadu_si256((const __m256i *)(s + i + qlen - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+					_mm256_cmpeq_epi8(first, vfirst),
+					_mm256_cmpeq_epi8(last, vlast)));
+		valid = len - qlen - i + 1;
+		if (valid < 32)
+			mask &= (1u << valid) - 1;
+		for (; mask != 0; mask &= mask - 1) {
+			j = __builtin_ctz(mask);
+			if (memcmp(s + i + j + 1, q + 1, qlen - 1) == 0)
+				return s + i + j;
+		}
+	}
+	return NULL;
+#elif defined(__SSE2__)
+	const __m128i vfirst = _mm_set1_epi8(q[0]);
+	const __m128i vlast = _mm_set1_epi8(q[qlen - 1]);
+
+	for (i = 0; i + qlen <= len; i += 16) {
+		__m128i first = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i last = _mm_loadu_si128((const __m128i *)(s + i + qlen - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(first, vfirst),
+					_mm_cmpeq_epi8(last, vlast)));
+		valid = len - qlen - i + 1;
+		if (valid < 16)
+			mask &= (1u << valid) - 1;
+		for (; mask != 0; mask &= mask - 1) {
+			j = __builtin_ctz(mask);
+			if (memcmp(s + i + j + 1, q + 1, qlen - 1) == 0)
+				return s + i + j;
+		}
+	}
+	return NULL;
+#else
+	(void) j;
+	(void) mask;
+	(void) valid;
+	for (i = 0; i + qlen <= len; i++) {
+		if (s[i] == q[0] && memcmp(s + i + 1, q + 1, qlen - 1) == 0)
+			return s + i;
+	}
+	return NULL;
+#endif
+}
+
+/* Scores the folded s against the folded query q, zero when it does not
+ * match */
+static int32_t search_score(const char *s, size_t len, const char *q, size_t qlen, bool fuzzy)
+{
+	size_t i, pos;
+	int32_t score, gaps;
+	const char *p, *end, *prev;
+
+	p = search_substring(s, len, q, qlen);
+	if (p != NULL) {
+		pos = p - s;
+		score = 2000;
+		if (pos == 0)
+			score += 1000;
+		else if (p[-1] == ' ' || p[-1] == '/' || p[-1] == '-' || p[-1] == '_'
+				|| p[-1] == '(' || p[-1] == '.')
+			score += 500;
+		score -= pos < 200 ? pos : 200;
+		score -= len - qlen < 200 ? len - qlen : 200;
+		return score;
+	}
+	if (!fuzzy)
+		return 0;
+
+	/* Subsequence, fewer and shorter gaps are better */
+	gaps = 0;
+	prev = NULL;
+	end = s + len;
+	p = s;
+	for (i = 0; i < qlen; i++) {
+		while (p < end && *p != q[i])
+			p++;
+		if (p == end)
+			return 0;
+		if (prev != NULL)
+			gaps += p - prev - 1;
+		prev = p++;
+	}
+	score = 1000 - (gaps < 900 ? gaps : 900);
+	return score;
+}
+
+static void songsearch_reset(struct lmpd_songsearch *search)
+{
+	free(search->ids);
+	free(search->offsets);
+	free(search->charsets);
+	free(search->text);
+	free(search->scores);
+	free(search->matched_strings);
+	free(search->matched_rows);
+	free(search->last);
+	search->ids = NULL;
+	search->offsets = NULL;
+	search->charsets = NULL;
+	search->text = NULL;
+	search->scores = NULL;
+	search->matched_strings = NULL;
+	search->matched_rows = NULL;
+	search->last = NULL;
+	search->nstrings = 0;
+	search->nmatched_strings = 0;
+	search->nmatched_rows = 0;
+	search->store = NULL;
+}
+
+static inline uint32_t songsearch_field(const struct lmpd_songstore *store, int field, unsigned row)
+{
+	if (field == LMPD_SEARCH_URI)
+		return store->uris[row];
+	if (store->columns[field] == NULL)
+		return 0;
+	return store->columns[field][row];
+}
+
+static int songsearch_idcmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Builds the folded text of the distinct strings in the fields, on first
+ * use and whenever the store has changed since. */
+static bool songsearch_prepare(struct lmpd_songsearch *search, const struct lmpd_songstore *store)
+{
+	int f;
+	unsigned row;
+	uint32_t i, id, len;
+	size_t j, size;
+	uint8_t *seen;
+	const char *s;
+	char *t;
+
+	if (search->store == store && search->store_rows == store->nrows
+			&& search->store_strings == store->nstrings)
+		return true;
+
+	songsearch_reset(search);
+	seen = calloc(store->nstrings, 1);
+	search->ids = malloc(store->nstrings * sizeof(uint32_t));
+	search->scores = calloc(store->nstrings, sizeof(int32_t));
+	search->matched_strings = malloc(store->nstrings * sizeof(uint32_t));
+	search->matched_rows = malloc((store->nrows + 1) * sizeof(unsigned));
+	if (seen == NULL || search->ids == NULL || search->scores == NULL
+			|| search->matched_strings == NULL || search->matched_rows == NULL)
+		goto oom;
+
+	size = 0;
+	for (f = 0; f < search->nfields; f++) {
+		for (row = 0; row < store->nrows; row++) {
+			id = songsearch_field(store, search->fields[f], row);
+			if (id != 0 && !seen[id]) {
+				seen[id] = 1;
+				search->ids[search->nstrings++] = id;
+				size += lmpd_songstore_strlen(store, id) + 1;
+			}
+		}
+	}
+	free(seen);
+	seen = NULL;
+
+	/* Keep the text in the order of the arena */
+	qsort(search->ids, search->nstrings, sizeof(uint32_t), songsearch_idcmp);
+
+	search->offsets = malloc((search->nstrings + 1) * sizeof(uint32_t));
+	search->charsets = malloc((search->nstrings + 1) * sizeof(uint64_t));
+	search->text = malloc(size + LMPD_SEARCH_SLACK);
+	if (search->offsets == NULL || search->charsets == NULL || search->text == NULL)
+		goto oom;
+
+	t = search->text;
+	for (i = 0; i < search->nstrings; i++) {
+		id = search->ids[i];
+		s = lmpd_songstore_string(store, id);
+		len = lmpd_songstore_strlen(store, id);
+		search->offsets[i] = t - search->text;
+		for (j = 0; j < len; j++)
+			t[j] = search_fold(s[j]);
+		t[len] = '\0';
+		search->charsets[i] = search_charset(t, len);
+		t += len + 1;
+	}
+	search->offsets[i] = t - search->text;
+	memset(t, 0, LMPD_SEARCH_SLACK);
+
+	search->store = store;
+	search->store_rows = store->nrows;
+	search->store_strings = store->nstrings;
+	return true;
+
+oom:
+	free(seen);
+	songsearch_reset(search);
+	return false;
+}
+
+/* Heap of the best hits with the worst one at the top */
+static inline bool hit_worse(const struct lmpd_hit *a, const struct lmpd_hit *b)
+{
+	return a->score < b->score || (a->score == b->score && a->row > b->row);
+}
+
+static void heap_sift_down(struct lmpd_hit *heap, unsigned n, unsigned i)
+{
+	unsigned child;
+	struct lmpd_hit tmp;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && hit_worse(&heap[child + 1], &heap[child]))
+			child++;
+		if (!hit_worse(&heap[child], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void heap_push(struct lmpd_hit *heap, unsigned *n, unsigned k, struct lmpd_hit hit)
+{
+	unsigned i, parent;
+	struct lmpd_hit tmp;
+
+	if (*n == k) {
+		if (!hit_worse(&heap[0], &hit))
+			return;
+		heap[0] = hit;
+		heap_sift_down(heap, *n, 0);
+		return;
+	}
+
+	i = (*n)++;
+	heap[i] = hit;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!hit_worse(&heap[i], &heap[parent]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
+}
+
+/* Scores the strings for the folded query, keeps the indices of the
+ * matches and returns their number */
+static uint32_t songsearch_match_strings(struct lmpd_songsearch *search,
+		const char *q, size_t qlen, bool fuzzy, bool refine)
+{
+	uint32_t i, n, idx, nmatched;
+	uint64_t charset;
+	int32_t score;
+
+	/* A string lacking any character of the query cannot match */
+	charset = search_charset(q, qlen);
+	n = refine ? search->nmatched_strings : search->nstrings;
+	nmatched = 0;
+	for (i = 0; i < n; i++) {
+		/* Matches are compacted in place, idx stays ahead */
+		idx = refine ? search->matched_strings[i] : i;
+		if ((charset & ~search->charsets[idx]) != 0)
+			continue;
+		score = search_score(search->text + search->offsets[idx],
+				search->offsets[idx + 1] - search->offsets[idx] - 1,
+				q, qlen, fuzzy);
+		if (score > 0) {
+			search->scores[search->ids[idx]] = score;
+			search->matched_strings[nmatched++] = idx;
+		}
+	}
+	return nmatched;
+}
+
+static int lmpdsongsearch_new(lua_State *L)
+{
+	int i, tag;
+	const char *name;
+	struct lmpd_songsearch *search;
+
+	lmpd_songstore_check(L, 1);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+	search = (struct lmpd_songsearch *) lua_newuserdata(L, sizeof(struct lmpd_songsearch));
+	memset(search, 0, sizeof(struct lmpd_songsearch));
+	luaL_getmetatable(L, MPD_SONGSEARCH_T);
+	lua_setmetatable(L, -2);
+
+	if (lua_isnoneornil(L, 2)) {
+		search->fields[0] = MPD_TAG_ARTIST;
+		search->fields[1] = MPD_TAG_ALBUM;
+		search->fields[2] = MPD_TAG_TITLE;
+		search->nfields = 3;
+	}
+	else {
+		for (i = 1; ; i++) {
+			lua_rawgeti(L, 2, i);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			name = luaL_checkstring(L, -1);
+			luaL_argcheck(L, search->nfields < LMPD_SEARCH_FIELDS, 2, "too many fields");
+			if (strncmp(name, "file", 5) == 0 || strncmp(name, "uri", 4) == 0)
+				tag = LMPD_SEARCH_URI;
+			else {
+				tag = mpd_tag_name_iparse(name);
+				if (tag == MPD_TAG_UNKNOWN)
+					return luaL_argerror(L, 2, lua_pushfstring(L, "unknown tag `%s'", name));
+			}
+			search->fields[search->nfields++] = tag;
+			lua_pop(L, 1);
+		}
+		luaL_argcheck(L, search->nfields > 0, 2, "no fields");
+	}
+
+	/* Keep the store alive */
+	lua_createtable(L, 0, 1);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "store");
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+static int lmpdsongsearch_gc(lua_State *L)
+{
+	struct lmpd_songsearch *search;
+
+	search = luaL_checkudata(L, 1, MPD_SONGSEARCH_T);
+	songsearch_reset(search);
+
+	return 0;
+}
+
+/* search:query(q[, k=50[, fuzzy=true]]) returns the handles of the best k
+ * rows and their scores, best first. */
+static int lmpdsongsearch_query(lua_State *L)
+{
+	bool fuzzy, refine;
+	int f, k;
+	size_t i, qlen;
+	unsigned n, row, nrows, nhits;
+	int32_t score, best;
+	char *q;
+	const char *query;
+	struct lmpd_hit *heap;
+	struct lmpd_hit tmp;
+	const struct lmpd_songstore *store;
+	struct lmpd_songsearch *search;
+
+	search = luaL_checkudata(L, 1, MPD_SONGSEARCH_T);
+	query = luaL_checklstring(L, 2, &qlen);
+	k = luaL_optinteger(L, 3, 50);
+	fuzzy = lua_isnoneornil(L, 4) ? true : lua_toboolean(L, 4);
+	luaL_argcheck(L, k > 0, 3, "k must be positive");
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "store");
+	store = lmpd_songstore_check(L, -1);
+	lua_pop(L, 2);
+
+	if (!songsearch_prepare(search, store))
+		goto oom;
+
+	/* Folded query at the top of the stack */
+	q = lua_newuserdata(L, qlen + 1);
+	for (i = 0; i < qlen; i++)
+		q[i] = search_fold(query[i]);
+	q[qlen] = '\0';
+
+	refine = search->last != NULL && search->last_fuzzy == fuzzy
+		&& strncmp(search->last, q, strlen(search->last)) == 0;
+
+	/* Clear the scores of the last query */
+	for (i = 0; i < search->nmatched_strings; i++)
+		search->scores[search->ids[search->matched_strings[i]]] = 0;
+	free(search->last);
+	search->last = NULL;
+
+	if (qlen == 0) {
+		search->nmatched_strings = 0;
+		search->nmatched_rows = 0;
+		lua_newtable(L);
+		lua_newtable(L);
+		return 2;
+	}
+
+	search->nmatched_strings = songsearch_match_strings(search, q, qlen, fuzzy, refine);
+
+	/* Score the rows by their best field */
+	heap = lua_newuserdata(L, k * sizeof(struct lmpd_hit));
+	nhits = 0;
+	if (search->nmatched_strings == 0)
+		nrows = 0;
+	else
+		nrows = refine ? search->nmatched_rows : store->nrows;
+	n = 0;
+	for (i = 0; i < nrows; i++) {
+		row = refine ? search->matched_rows[i] : i;
+		best = 0;
+		for (f = 0; f < search->nfields; f++) {
+			score = search->scores[songsearch_field(store, search->fields[f], row)];
+			if (score > best)
+				best = score;
+		}
+		if (best == 0)
+			continue;
+		search->matched_rows[n++] = row;
+		tmp.score = best;
+		tmp.row = row;
+		heap_push(heap, &nhits, k, tmp);
+	}
+	search->nmatched_rows = n;
+
+	search->last = strdup(q);
+	search->last_fuzzy = fuzzy;
+	if (search->last == NULL)
+		goto oom;
+
+	/* Pop the worst first to fill the results from the back */
+	lua_createtable(L, nhits, 0);
+	lua_createtable(L, nhits, 0);
+	while (nhits > 0) {
+		tmp = heap[0];
+		heap[0] = heap[--nhits];
+		heap_sift_down(heap, nhits, 0);
+		lua_pushinteger(L, tmp.row + 1);
+		lua_rawseti(L, -3, nhits + 1);
+		lua_pushinteger(L, tmp.score);
+		lua_rawseti(L, -2, nhits + 1);
+	}
+	return 2;
+
+oom:
+	songsearch_reset(search);
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushliteral(L, "out of memory");
+	return 2;
+}
+
+static int lmpdsongsearch_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_songsearch *search;
+
+	search = luaL_checkudata(L, 1, MPD_SONGSEARCH_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "query", 6) == 0)
+		lua_pushcfunction(L, lmpdsongsearch_query);
+	else if (strncmp(key, "matches", 8) == 0)
+		lua_pushinteger(L, search->nmatched_rows);
+	else if (strncmp(key, "last", 5) == 0) {
+		if (search->last == NULL)
+			lua_pushnil(L);
+		else
+			lua_pushstring(L, search->last);
+	}
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static const luaL_reg lreg_songsearch[] = {
+	{"__gc",	lmpdsongsearch_gc},
+	{"__index",	lmpdsongsearch_index},
+	{NULL,		NULL},
+};
+
+void linit_songsearch(lua_State *L)
+{
+	/* Register MPD_SONGSEARCH_T metatable */
+	luaL_newmetatable(L, MPD_SONGSEARCH_T);
+	luaL_register(L, NULL, lreg_songsearch);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_song_search");
+	lua_pushcfunction(L, lmpdsongsearch_new);
+	lua_settable(L, -3);
+}
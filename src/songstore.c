@@ -0,0 +1,731 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Song store:
+ * A compact container for large song sets. Strings are copied into a bump
+ * arena and tag values are interned, so a library with a few thousand
+ * artists keeps a few thousand artist strings. Rows are referred to by
+ * integer handles starting at one. Freeing the store releases the arena
+ * chunks and the columns, independent of the number of songs. Stores are
+ * reference counted; a frozen store, one published as a snapshot, is
+ * copied before it is modified.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/database.h>
+#include <mpd/entity.h>
+#include <mpd/response.h>
+#include <mpd/song.h>
+#include <mpd/tag.h>
+
+#include "globals.h"
+
+#define LMPD_ARENA_CHUNK	(1 << 20)
+
+struct lmpd_arena_chunk {
+	struct lmpd_arena_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+/* Returns size bytes aligned for uint32_t from the arena */
+static void *songstore_alloc(struct lmpd_songstore *store, size_t size)
+{
+	size_t chunk_size;
+	struct lmpd_arena_chunk *chunk;
+
+	size = (size + 3) & ~(size_t) 3;
+	chunk = store->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk_size = size > LMPD_ARENA_CHUNK ? size : LMPD_ARENA_CHUNK;
+		chunk = malloc(sizeof(struct lmpd_arena_chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = chunk_size;
+		/* A big string gets its own chunk behind the current one */
+		if (size > LMPD_ARENA_CHUNK && store->chunks != NULL) {
+			chunk->next = store->chunks->next;
+			store->chunks->next = chunk;
+		}
+		else {
+			chunk->next = store->chunks;
+			store->chunks = chunk;
+		}
+		store->bytes += sizeof(struct lmpd_arena_chunk) + chunk_size;
+	}
+
+	chunk->used += size;
+	return chunk->data + chunk->used - size;
+}
+
+static uint32_t songstore_hash(const char *s, size_t len)
+{
+	size_t i;
+	uint32_t h;
+
+	/* FNV-1a */
+	h = 2166136261u;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Copies s into the arena, returns its id or zero without memory */
+static uint32_t songstore_push_string(struct lmpd_songstore *store, const char *s, size_t len)
+{
+	uint32_t size;
+	uint32_t *p;
+	const char **strings;
+
+	if (store->nstrings == store->strings_size) {
+		size = store->strings_size * 2;
+		strings = realloc(store->strings, size * sizeof(const char *));
+		if (strings == NULL)
+			return 0;
+		store->bytes += (size - store->strings_size) * sizeof(const char *);
+		store->strings = strings;
+		store->strings_size = size;
+	}
+
+	p = songstore_alloc(store, sizeof(uint32_t) + len + 1);
+	if (p == NULL)
+		return 0;
+	p[0] = len;
+	memcpy(p + 1, s, len);
+	((char *)(p + 1))[len] = '\0';
+
+	store->strings[store->nstrings] = (const char *)(p + 1);
+	return store->nstrings++;
+}
+
+static bool songstore_rehash(struct lmpd_songstore *store)
+{
+	uint32_t i, j, size, mask;
+	uint32_t *hash;
+
+	size = store->hash_size * 2;
+	hash = calloc(size, sizeof(uint32_t));
+	if (hash == NULL)
+		return false;
+
+	mask = size - 1;
+	for (i = 0; i < store->hash_size; i++) {
+		if (store->hash[i] == 0)
+			continue;
+		j = songstore_hash(lmpd_songstore_string(store, store->hash[i]),
+				lmpd_songstore_strlen(store, store->hash[i])) & mask;
+		while (hash[j] != 0)
+			j = (j + 1) & mask;
+		hash[j] = store->hash[i];
+	}
+
+	store->bytes += (size - store->hash_size) * sizeof(uint32_t);
+	free(store->hash);
+	store->hash = hash;
+	store->hash_size = size;
+	return true;
+}
+
+/* Returns the id of the interned copy of s, zero without memory */
+static uint32_t songstore_intern(struct lmpd_songstore *store, const char *s)
+{
+	size_t len;
+	uint32_t i, id, mask;
+
+	/* The table holds tag values only, keep it at most half full */
+	if (store->ninterned >= store->hash_size / 2 && !songstore_rehash(store))
+		return 0;
+
+	len = strlen(s);
+	mask = store->hash_size - 1;
+	for (i = songstore_hash(s, len) & mask; store->hash[i] != 0; i = (i + 1) & mask) {
+		id = store->hash[i];
+		if (lmpd_songstore_strlen(store, id) == len
+				&& memcmp(lmpd_songstore_string(store, id), s, len) == 0)
+			return id;
+	}
+
+	id = songstore_push_string(store, s, len);
+	if (id != 0) {
+		store->hash[i] = id;
+		store->ninterned++;
+	}
+	return id;
+}
+
+static bool songstore_grow(struct lmpd_songstore *store)
+{
+	int t;
+	unsigned size;
+	uint32_t *uris, *column;
+	unsigned *durations;
+
+	size = store->rows_size * 2;
+	uris = realloc(store->uris, size * sizeof(uint32_t));
+	if (uris == NULL)
+		return false;
+	store->uris = uris;
+	durations = realloc(store->durations, size * sizeof(unsigned));
+	if (durations == NULL)
+		return false;
+	store->durations = durations;
+	store->bytes += (size - store->rows_size) * (sizeof(uint32_t) + sizeof(unsigned));
+
+	for (t = 0; t < MPD_TAG_COUNT; t++) {
+		if (store->columns[t] == NULL)
+			continue;
+		column = realloc(store->columns[t], size * sizeof(uint32_t));
+		if (column == NULL)
+			return false;
+		memset(column + store->rows_size, 0, (size - store->rows_size) * sizeof(uint32_t));
+		store->columns[t] = column;
+		store->bytes += (size - store->rows_size) * sizeof(uint32_t);
+	}
+
+	store->rows_size = size;
+	return true;
+}
+
+/* Appends song, returns false without memory. The row is only counted
+ * once it is complete. */
+static bool songstore_add(struct lmpd_songstore *store, const struct mpd_song *song)
+{
+	int t;
+	unsigned row;
+	uint32_t id;
+	const char *uri, *value;
+
+	if (store->nrows == store->rows_size && !songstore_grow(store))
+		return false;
+	row = store->nrows;
+
+	uri = mpd_song_get_uri(song);
+	id = songstore_push_string(store, uri, strlen(uri));
+	if (id == 0)
+		return false;
+	store->uris[row] = id;
+	store->durations[row] = mpd_song_get_duration(song);
+
+	for (t = 0; t < MPD_TAG_COUNT; t++) {
+		value = mpd_song_get_tag(song, t, 0);
+		if (value == NULL) {
+			if (store->columns[t] != NULL)
+				store->columns[t][row] = 0;
+			continue;
+		}
+		if (store->columns[t] == NULL) {
+			store->columns[t] = calloc(store->rows_size, sizeof(uint32_t));
+			if (store->columns[t] == NULL)
+				return false;
+			store->bytes += store->rows_size * sizeof(uint32_t);
+		}
+		id = songstore_intern(store, value);
+		if (id == 0)
+			return false;
+		store->columns[t][row] = id;
+	}
+
+	store->nrows++;
+	return true;
+}
+
+static void songstore_free(struct lmpd_songstore *store)
+{
+	int t;
+	struct lmpd_arena_chunk *chunk, *next;
+
+	for (chunk = store->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	if (store->columns != NULL) {
+		for (t = 0; t < MPD_TAG_COUNT; t++)
+			free(store->columns[t]);
+	}
+	free(store->columns);
+	free(store->uris);
+	free(store->durations);
+	free(store->hash);
+	free(store->strings);
+	free(store);
+}
+
+static struct lmpd_songstore *songstore_new(void)
+{
+	struct lmpd_songstore *store;
+
+	store = calloc(1, sizeof(struct lmpd_songstore));
+	if (store == NULL)
+		return NULL;
+
+	store->strings_size = 1024;
+	store->hash_size = 1024;
+	store->rows_size = 1024;
+	store->strings = malloc(store->strings_size * sizeof(const char *));
+	store->hash = calloc(store->hash_size, sizeof(uint32_t));
+	store->uris = malloc(store->rows_size * sizeof(uint32_t));
+	store->durations = malloc(store->rows_size * sizeof(unsigned));
+	store->columns = calloc(MPD_TAG_COUNT, sizeof(uint32_t *));
+	if (store->strings == NULL || store->hash == NULL || store->uris == NULL
+			|| store->durations == NULL || store->columns == NULL) {
+		songstore_free(store);
+		return NULL;
+	}
+	store->bytes = sizeof(struct lmpd_songstore)
+		+ store->strings_size * sizeof(const char *)
+		+ store->hash_size * sizeof(uint32_t)
+		+ store->rows_size * (sizeof(uint32_t) + sizeof(unsigned))
+		+ MPD_TAG_COUNT * sizeof(uint32_t *);
+
+	/* id zero is none */
+	store->strings[0] = NULL;
+	store->nstrings = 1;
+	store->refs = 1;
+
+	return store;
+}
+
+/* Returns an unfrozen copy of store with the same ids and handles */
+static struct lmpd_songstore *songstore_clone(const struct lmpd_songstore *store)
+{
+	int t;
+	uint32_t id;
+	size_t columns;
+	struct lmpd_songstore *copy;
+
+	copy = calloc(1, sizeof(struct lmpd_songstore));
+	if (copy == NULL)
+		return NULL;
+
+	copy->strings_size = store->strings_size;
+	copy->hash_size = store->hash_size;
+	copy->rows_size = store->rows_size;
+	copy->strings = malloc(copy->strings_size * sizeof(const char *));
+	copy->hash = malloc(copy->hash_size * sizeof(uint32_t));
+	copy->uris = malloc(copy->rows_size * sizeof(uint32_t));
+	copy->durations = malloc(copy->rows_size * sizeof(unsigned));
+	copy->columns = calloc(MPD_TAG_COUNT, sizeof(uint32_t *));
+	if (copy->strings == NULL || copy->hash == NULL || copy->uris == NULL
+			|| copy->durations == NULL || copy->columns == NULL)
+		goto oom;
+
+	copy->bytes = sizeof(struct lmpd_songstore)
+		+ copy->strings_size * sizeof(const char *)
+		+ copy->hash_size * sizeof(uint32_t)
+		+ copy->rows_size * (sizeof(uint32_t) + sizeof(unsigned))
+		+ MPD_TAG_COUNT * sizeof(uint32_t *);
+
+	/* Pushing the strings in order keeps their ids, the hash stays valid */
+	copy->strings[0] = NULL;
+	copy->nstrings = 1;
+	for (id = 1; id < store->nstrings; id++) {
+		if (songstore_push_string(copy, lmpd_songstore_string(store, id),
+					lmpd_songstore_strlen(store, id)) != id)
+			goto oom;
+	}
+	memcpy(copy->hash, store->hash, copy->hash_size * sizeof(uint32_t));
+	copy->ninterned = store->ninterned;
+
+	memcpy(copy->uris, store->uris, store->nrows * sizeof(uint32_t));
+	memcpy(copy->durations, store->durations, store->nrows * sizeof(unsigned));
+	columns = copy->rows_size * sizeof(uint32_t);
+	for (t = 0; t < MPD_TAG_COUNT; t++) {
+		if (store->columns[t] == NULL)
+			continue;
+		copy->columns[t] = malloc(columns);
+		if (copy->columns[t] == NULL)
+			goto oom;
+		memcpy(copy->columns[t], store->columns[t], columns);
+		copy->bytes += columns;
+	}
+	copy->nrows = store->nrows;
+	copy->refs = 1;
+
+	return copy;
+
+oom:
+	songstore_free(copy);
+	return NULL;
+}
+
+void lmpd_songstore_ref(struct lmpd_songstore *store)
+{
+	__atomic_add_fetch(&store->refs, 1, __ATOMIC_RELAXED);
+}
+
+void lmpd_songstore_unref(struct lmpd_songstore *store)
+{
+	if (__atomic_sub_fetch(&store->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		songstore_free(store);
+}
+
+/* Pushes a userdata for store, taking over one reference */
+void lmpd_songstore_push(lua_State *L, struct lmpd_songstore *store)
+{
+	struct lmpd_songstore **ud;
+
+	ud = (struct lmpd_songstore **) lua_newuserdata(L, sizeof(struct lmpd_songstore *));
+	*ud = NULL;
+	luaL_getmetatable(L, MPD_SONGSTORE_T);
+	lua_setmetatable(L, -2);
+	*ud = store;
+}
+
+/* Returns the store at idx ready for modification, copying it first when
+ * it is frozen, or NULL without memory. */
+static struct lmpd_songstore *lmpdsongstore_check_writable(lua_State *L, int idx)
+{
+	struct lmpd_songstore **ud;
+	struct lmpd_songstore *copy;
+
+	ud = luaL_checkudata(L, idx, MPD_SONGSTORE_T);
+	assert(*ud != NULL);
+
+	if (!(*ud)->frozen)
+		return *ud;
+
+	copy = songstore_clone(*ud);
+	if (copy == NULL)
+		return NULL;
+	lmpd_songstore_unref(*ud);
+	*ud = copy;
+	return copy;
+}
+
+struct lmpd_songstore *lmpd_songstore_check(lua_State *L, int idx)
+{
+	struct lmpd_songstore **store;
+
+	store = luaL_checkudata(L, idx, MPD_SONGSTORE_T);
+	assert(*store != NULL);
+	return *store;
+}
+
+const char *lmpd_songstore_tag(const struct lmpd_songstore *store, unsigned row, int tag)
+{
+	assert(row < store->nrows);
+
+	if (tag < 0 || tag >= MPD_TAG_COUNT || store->columns[tag] == NULL)
+		return NULL;
+	return lmpd_songstore_string(store, store->columns[tag][row]);
+}
+
+/* Checks the handle at idx, returns the row */
+static unsigned lmpdsongstore_check_handle(lua_State *L, int idx,
+		const struct lmpd_songstore *store)
+{
+	int handle;
+
+	handle = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, handle >= 1 && (unsigned) handle <= store->nrows, idx,
+			"invalid handle");
+	return handle - 1;
+}
+
+static int lmpdsongstore_new(lua_State *L)
+{
+	struct lmpd_songstore **store;
+
+	store = (struct lmpd_songstore **) lua_newuserdata(L, sizeof(struct lmpd_songstore *));
+	luaL_getmetatable(L, MPD_SONGSTORE_T);
+	lua_setmetatable(L, -2);
+
+	*store = songstore_new();
+	if (*store == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+
+	return 1;
+}
+
+static int lmpdsongstore_gc(lua_State *L)
+{
+	struct lmpd_songstore **store;
+
+	store = luaL_checkudata(L, 1, MPD_SONGSTORE_T);
+
+	if (*store != NULL)
+		lmpd_songstore_unref(*store);
+	*store = NULL;
+
+	return 0;
+}
+
+/* store:ingest(conn) adds the songs of the current response, stopping at
+ * its end like recv_song(). Returns the number of songs added. */
+static int lmpdsongstore_ingest(lua_State *L)
+{
+	unsigned count;
+	bool oom;
+	struct lmpd_songstore *store;
+	struct mpd_connection **conn;
+	struct mpd_entity *entity;
+
+	lmpd_songstore_check(L, 1);
+	conn = lmpdconn_check(L, 2);
+
+	assert(*conn != NULL);
+
+	store = lmpdsongstore_check_writable(L, 1);
+	count = 0;
+	oom = store == NULL;
+	while ((entity = mpd_recv_entity(*conn)) != NULL) {
+		if (!oom && mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+			if (songstore_add(store, mpd_entity_get_song(entity)))
+				count++;
+			else
+				oom = true;
+		}
+		mpd_entity_free(entity);
+	}
+
+	if (oom) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	if (mpd_connection_get_error(*conn) != MPD_ERROR_SUCCESS) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+/* store:load(conn[, path]) adds every song below path with listallinfo */
+static int lmpdsongstore_load(lua_State *L)
+{
+	int nret;
+	const char *path;
+	struct mpd_connection **conn;
+
+	lmpd_songstore_check(L, 1);
+	conn = lmpdconn_check(L, 2);
+	path = luaL_optstring(L, 3, "");
+	lua_settop(L, 2);
+
+	assert(*conn != NULL);
+
+	if (!mpd_send_list_all_meta(*conn, path)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+
+	nret = lmpdsongstore_ingest(L);
+	if (!mpd_response_finish(*conn) && nret == 1) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+	return nret;
+}
+
+/* store:add(song) copies an MPD_SONG_T, returns its handle */
+static int lmpdsongstore_add(lua_State *L)
+{
+	struct lmpd_songstore *store;
+	struct mpd_song **song;
+
+	lmpd_songstore_check(L, 1);
+	song = luaL_checkudata(L, 2, MPD_SONG_T);
+
+	assert(*song != NULL);
+
+	store = lmpdsongstore_check_writable(L, 1);
+	if (store == NULL || !songstore_add(store, *song)) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+
+	lua_pushinteger(L, store->nrows);
+	return 1;
+}
+
+static int lmpdsongstore_uri(lua_State *L)
+{
+	unsigned row;
+	struct lmpd_songstore *store;
+
+	store = lmpd_songstore_check(L, 1);
+	row = lmpdsongstore_check_handle(L, 2, store);
+
+	lua_pushlstring(L, lmpd_songstore_string(store, store->uris[row]),
+			lmpd_songstore_strlen(store, store->uris[row]));
+	return 1;
+}
+
+static int lmpdsongstore_duration(lua_State *L)
+{
+	unsigned row;
+	struct lmpd_songstore *store;
+
+	store = lmpd_songstore_check(L, 1);
+	row = lmpdsongstore_check_handle(L, 2, store);
+
+	lua_pushinteger(L, store->durations[row]);
+	return 1;
+}
+
+/* store:tag(handle, tag) returns the first value of the tag, an MPD_TAG_*
+ * constant or a tag name, or nil */
+static int lmpdsongstore_tag(lua_State *L)
+{
+	int tag;
+	unsigned row;
+	const char *value;
+	struct lmpd_songstore *store;
+
+	store = lmpd_songstore_check(L, 1);
+	row = lmpdsongstore_check_handle(L, 2, store);
+
+	if (lua_type(L, 3) == LUA_TNUMBER)
+		tag = lua_tointeger(L, 3);
+	else
+		tag = mpd_tag_name_iparse(luaL_checkstring(L, 3));
+	luaL_argcheck(L, tag >= 0 && tag < MPD_TAG_COUNT, 3, "unknown tag");
+
+	value = lmpd_songstore_tag(store, row, tag);
+	if (value == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushstring(L, value);
+	return 1;
+}
+
+static int lmpdsongstore_clear(lua_State *L)
+{
+	struct lmpd_songstore **store;
+	struct lmpd_songstore *fresh;
+
+	store = luaL_checkudata(L, 1, MPD_SONGSTORE_T);
+
+	assert(*store != NULL);
+
+	fresh = songstore_new();
+	if (fresh == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+	lmpd_songstore_unref(*store);
+	*store = fresh;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lmpdsongstore_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_songstore *store;
+
+	store = lmpd_songstore_check(L, 1);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "ingest", 7) == 0)
+		lua_pushcfunction(L, lmpdsongstore_ingest);
+	else if (strncmp(key, "load", 5) == 0)
+		lua_pushcfunction(L, lmpdsongstore_load);
+	else if (strncmp(key, "add", 4) == 0)
+		lua_pushcfunction(L, lmpdsongstore_add);
+	else if (strncmp(key, "uri", 4) == 0)
+		lua_pushcfunction(L, lmpdsongstore_uri);
+	else if (strncmp(key, "duration", 9) == 0)
+		lua_pushcfunction(L, lmpdsongstore_duration);
+	else if (strncmp(key, "tag", 4) == 0)
+		lua_pushcfunction(L, lmpdsongstore_tag);
+	else if (strncmp(key, "clear", 6) == 0)
+		lua_pushcfunction(L, lmpdsongstore_clear);
+	else if (strncmp(key, "count", 6) == 0)
+		lua_pushinteger(L, store->nrows);
+	else if (strncmp(key, "strings", 8) == 0)
+		lua_pushinteger(L, store->ninterned);
+	else if (strncmp(key, "bytes", 6) == 0)
+		lua_pushnumber(L, store->bytes);
+	else if (strncmp(key, "frozen", 7) == 0)
+		lua_pushboolean(L, store->frozen);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static int lmpdsongstore_len(lua_State *L)
+{
+	lua_pushinteger(L, lmpd_songstore_check(L, 1)->nrows);
+	return 1;
+}
+
+static const luaL_reg lreg_songstore[] = {
+	{"__gc",	lmpdsongstore_gc},
+	{"__index",	lmpdsongstore_index},
+	{"__len",	lmpdsongstore_len},
+	{NULL,		NULL},
+};
+
+void linit_songstore(lua_State *L)
+{
+	/* Register MPD_SONGSTORE_T metatable */
+	luaL_newmetatable(L, MPD_SONGSTORE_T);
+	luaL_register(L, NULL, lreg_songstore);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_song_store");
+	lua_pushcfunction(L, lmpdsongstore_new);
+	lua_settable(L, -3);
+}
@@ -0,0 +1,341 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Sorting:
+ * mpdclient.sort() orders an array of songs, or the rows of a song store,
+ * by a list of tags. The keys are computed once per song: track and disc
+ * numbers are parsed, other tags go through strxfrm() so the comparison
+ * follows the collation of the current locale. Songs missing a tag sort
+ * after the others. A stable merge sort orders the whole set; when only
+ * the first k songs are wanted a heap selects them first.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/song.h>
+#include <mpd/tag.h>
+
+#include "globals.h"
+
+#define LMPD_SORT_KEYS_MAX	16
+/* Marks a missing value, sorts last */
+#define LMPD_SORT_NONE		UINT32_MAX
+
+struct lmpd_sortkey {
+	/* number, or offset of the transformed string in the text */
+	uint32_t value;
+};
+
+struct lmpd_sort {
+	int tags[LMPD_SORT_KEYS_MAX];
+	bool numeric[LMPD_SORT_KEYS_MAX];
+	int nkeys;
+	/* nkeys keys per song */
+	struct lmpd_sortkey *keys;
+	char *text;
+	size_t textlen;
+	size_t textsize;
+};
+
+static bool sort_numeric_tag(int tag)
+{
+	return tag == MPD_TAG_TRACK || tag == MPD_TAG_DISC;
+}
+
+/* Appends the collation key of s to the text, returns its offset */
+static uint32_t sort_push_text(struct lmpd_sort *sort, const char *s)
+{
+	size_t len, size;
+	char *text;
+
+	for (;;) {
+		len = strxfrm(sort->text + sort->textlen, s, sort->textsize - sort->textlen);
+		if (sort->textlen + len < sort->textsize)
+			break;
+		size = sort->textsize * 2 + len + 1;
+		if (size > UINT32_MAX)
+			return LMPD_SORT_NONE;
+		text = realloc(sort->text, size);
+		if (text == NULL)
+			return LMPD_SORT_NONE;
+		sort->text = text;
+		sort->textsize = size;
+	}
+
+	sort->textlen += len + 1;
+	return sort->textlen - len - 1;
+}
+
+/* Computes the keys of song i from its tag values */
+static bool sort_set_keys(struct lmpd_sort *sort, unsigned i, const char *const *values)
+{
+	int j;
+	unsigned long number;
+	char *end;
+	struct lmpd_sortkey *key;
+
+	for (j = 0; j < sort->nkeys; j++) {
+		key = &sort->keys[(size_t) i * sort->nkeys + j];
+		if (values[j] == NULL) {
+			key->value = LMPD_SORT_NONE;
+			continue;
+		}
+		if (sort->numeric[j]) {
+			/* "3/12" is track three */
+			number = strtoul(values[j], &end, 10);
+			key->value = end == values[j] || number >= LMPD_SORT_NONE
+				? LMPD_SORT_NONE : number;
+			continue;
+		}
+		key->value = sort_push_text(sort, values[j]);
+		if (key->value == LMPD_SORT_NONE)
+			return false;
+	}
+	return true;
+}
+
+/* Orders songs a and b, ties keep the original order */
+static int sort_cmp(const struct lmpd_sort *sort, uint32_t a, uint32_t b)
+{
+	int j, c;
+	const struct lmpd_sortkey *ka, *kb;
+
+	ka = &sort->keys[(size_t) a * sort->nkeys];
+	kb = &sort->keys[(size_t) b * sort->nkeys];
+	for (j = 0; j < sort->nkeys; j++) {
+		if (ka[j].value == kb[j].value)
+			continue;
+		if (ka[j].value == LMPD_SORT_NONE)
+			return 1;
+		if (kb[j].value == LMPD_SORT_NONE)
+			return -1;
+		if (sort->numeric[j])
+			return ka[j].value < kb[j].value ? -1 : 1;
+		c = strcmp(sort->text + ka[j].value, sort->text + kb[j].value);
+		if (c != 0)
+			return c;
+	}
+	return a < b ? -1 : a > b;
+}
+
+/* Bottom up merge sort of idx using tmp of the same size */
+static void sort_merge(const struct lmpd_sort *sort, uint32_t *idx, uint32_t *tmp, unsigned n)
+{
+	unsigned width, lo, mid, hi, i, j, k;
+	uint32_t *src, *dst, *swap;
+
+	src = idx;
+	dst = tmp;
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = lo + width < n ? lo + width : n;
+			hi = lo + 2 * width < n ? lo + 2 * width : n;
+			i = lo;
+			j = mid;
+			k = lo;
+			while (i < mid && j < hi)
+				dst[k++] = sort_cmp(sort, src[i], src[j]) <= 0 ? src[i++] : src[j++];
+			while (i < mid)
+				dst[k++] = src[i++];
+			while (j < hi)
+				dst[k++] = src[j++];
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != idx)
+		memcpy(idx, src, n * sizeof(uint32_t));
+}
+
+static void sort_sift_down(const struct lmpd_sort *sort, uint32_t *heap, unsigned n, unsigned i)
+{
+	unsigned child;
+	uint32_t tmp;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n && sort_cmp(sort, heap[child + 1], heap[child]) > 0)
+			child++;
+		if (sort_cmp(sort, heap[child], heap[i]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Leaves the first k of n songs in idx[0..k), unordered. The heap keeps
+ * the last of the best so far at the top. */
+static void sort_select(const struct lmpd_sort *sort, uint32_t *idx, unsigned n, unsigned k)
+{
+	unsigned i;
+
+	for (i = k / 2; i-- > 0; )
+		sort_sift_down(sort, idx, k, i);
+	for (i = k; i < n; i++) {
+		if (sort_cmp(sort, idx[i], idx[0]) < 0) {
+			idx[0] = idx[i];
+			sort_sift_down(sort, idx, k, 0);
+		}
+	}
+}
+
+/* mpdclient.sort(songs, keys[, k]) returns a new array with the songs
+ * ordered by the tags in keys, tag constants or names. songs is an array
+ * of MPD_SONG_T or a song store, whose handles are returned then. With k
+ * only the first k are returned. */
+static int lmpd_sort(lua_State *L)
+{
+	bool ok;
+	int j, tag;
+	unsigned i, n, k;
+	lua_Integer limit;
+	uint32_t *idx, *tmp;
+	const char *values[LMPD_SORT_KEYS_MAX];
+	struct lmpd_sort sort;
+	struct lmpd_songstore *store;
+	struct mpd_song **song;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	store = NULL;
+	if (lua_type(L, 1) == LUA_TUSERDATA)
+		store = lmpd_songstore_check(L, 1);
+	else
+		luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 3);
+
+	memset(&sort, 0, sizeof(struct lmpd_sort));
+	for (j = 1; ; j++) {
+		lua_rawgeti(L, 2, j);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		if (lua_type(L, -1) == LUA_TNUMBER)
+			tag = lua_tointeger(L, -1);
+		else
+			tag = mpd_tag_name_iparse(luaL_checkstring(L, -1));
+		luaL_argcheck(L, tag >= 0 && tag < MPD_TAG_COUNT, 2, "unknown tag");
+		luaL_argcheck(L, sort.nkeys < LMPD_SORT_KEYS_MAX, 2, "too many keys");
+		sort.tags[sort.nkeys] = tag;
+		sort.numeric[sort.nkeys] = sort_numeric_tag(tag);
+		sort.nkeys++;
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, sort.nkeys > 0, 2, "no keys");
+
+	/* Check every song before anything is allocated outside of Lua */
+	n = store != NULL ? store->nrows : lua_objlen(L, 1);
+	if (store == NULL) {
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 1, i);
+			song = luaL_checkudata(L, -1, MPD_SONG_T);
+			luaL_argcheck(L, *song != NULL, 1, "freed song");
+			lua_pop(L, 1);
+		}
+	}
+	if (lua_isnil(L, 3))
+		k = n;
+	else {
+		limit = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, limit >= 0, 3, "negative count");
+		k = limit < (lua_Integer) n ? (unsigned) limit : n;
+	}
+
+	/* idx and tmp at 4, keys at 5 */
+	idx = lua_newuserdata(L, 2 * (n + 1) * sizeof(uint32_t));
+	tmp = idx + n + 1;
+	sort.keys = lua_newuserdata(L, ((size_t) n * sort.nkeys + 1) * sizeof(struct lmpd_sortkey));
+
+	sort.textsize = 4096;
+	sort.text = malloc(sort.textsize);
+	ok = sort.text != NULL;
+	for (i = 0; ok && i < n; i++) {
+		if (store != NULL) {
+			for (j = 0; j < sort.nkeys; j++)
+				values[j] = lmpd_songstore_tag(store, i, sort.tags[j]);
+		}
+		else {
+			lua_rawgeti(L, 1, i + 1);
+			song = lua_touserdata(L, -1);
+			for (j = 0; j < sort.nkeys; j++)
+				values[j] = mpd_song_get_tag(*song, sort.tags[j], 0);
+			lua_pop(L, 1);
+		}
+		ok = sort_set_keys(&sort, i, values);
+		idx[i] = i;
+	}
+	if (!ok) {
+		free(sort.text);
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushliteral(L, "out of memory");
+		return 2;
+	}
+
+	if (k < n) {
+		if (k > 0)
+			sort_select(&sort, idx, n, k);
+		n = k;
+	}
+	sort_merge(&sort, idx, tmp, n);
+	free(sort.text);
+
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		if (store != NULL)
+			lua_pushinteger(L, idx[i] + 1);
+		else
+			lua_rawgeti(L, 1, idx[i] + 1);
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+
+void linit_sort(lua_State *L)
+{
+	lua_pushliteral(L, "sort");
+	lua_pushcfunction(L, lmpd_sort);
+	lua_settable(L, -3);
+}
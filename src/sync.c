@@ -0,0 +1,520 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Library sync:
+ * Keeps a local song table keyed by uri in step with the server database.
+ * The first update lists the whole database once. Later ones list the
+ * root and descend, one command list per level, only into directories
+ * whose Last-Modified differs from the one seen last, then find the songs
+ * modified since the newest one seen, so the cost follows the size of the
+ * change rather than of the library. A song deleted below a directory
+ * whose time did not change, such as one track of an album, is only
+ * noticed once that directory is listed again. The differences are
+ * passed to the added, removed and changed callbacks once the song table
+ * is up to date.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/database.h>
+#include <mpd/directory.h>
+#include <mpd/entity.h>
+#include <mpd/list.h>
+#include <mpd/response.h>
+#include <mpd/song.h>
+
+#include "globals.h"
+
+struct lmpd_sync {
+	unsigned count;
+	bool primed;
+	/* Last-Modified of the newest song seen */
+	time_t newest;
+};
+
+static int lmpdsync_new(lua_State *L)
+{
+	struct lmpd_sync *sync;
+
+	if (!lua_isnoneornil(L, 1))
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+	sync = (struct lmpd_sync *) lua_newuserdata(L, sizeof(struct lmpd_sync));
+	sync->count = 0;
+	sync->primed = false;
+	sync->newest = 0;
+	luaL_getmetatable(L, MPD_SYNC_T);
+	lua_setmetatable(L, -2);
+
+	/* songs maps uri to songs, mtimes uri and dirs path to Last-Modified */
+	lua_createtable(L, 0, 4);
+	lua_newtable(L);
+	lua_setfield(L, -2, "songs");
+	lua_newtable(L);
+	lua_setfield(L, -2, "mtimes");
+	lua_newtable(L);
+	lua_setfield(L, -2, "dirs");
+	if (lua_istable(L, 1))
+		lua_pushvalue(L, 1);
+	else
+		lua_newtable(L);
+	lua_setfield(L, -2, "callbacks");
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+/* Pushes the directory part of uri */
+static void lmpdsync_push_dirname(lua_State *L, const char *uri)
+{
+	const char *slash;
+
+	slash = strrchr(uri, '/');
+	lua_pushlstring(L, uri, slash != NULL ? (size_t)(slash - uri) : 0);
+}
+
+/* Queues callbacks[name] to be called with the two values on the top of
+ * the stack, which are popped, as the n-th entry of the array at events */
+static void lmpdsync_defer(lua_State *L, int events, unsigned n, const char *name)
+{
+	lua_rawseti(L, events, 3 * n + 3);
+	lua_rawseti(L, events, 3 * n + 2);
+	lua_pushstring(L, name);
+	lua_rawseti(L, events, 3 * n + 1);
+}
+
+/* Calls the n callbacks queued in the array at events */
+static void lmpdsync_emit(lua_State *L, int callbacks, int events, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, events, 3 * i + 1);
+		lua_rawget(L, callbacks);
+		if (!lua_isfunction(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_rawgeti(L, events, 3 * i + 2);
+		lua_rawgeti(L, events, 3 * i + 3);
+		if (lua_isnil(L, -1)) {
+			/* added takes the song alone */
+			lua_pop(L, 1);
+			lua_call(L, 1, 0);
+		}
+		else
+			lua_call(L, 2, 0);
+	}
+}
+
+/* Reads the entities of the current response. Songs are appended to the
+ * array at fetched with their Last-Modified set in seen and kept in newest
+ * if later, directories have theirs set in newdirs and, when next is not 0
+ * and it differs from the one in dirs, are appended to the array at next
+ * to be listed too. */
+static bool lmpdsync_recv(lua_State *L, struct mpd_connection *conn, time_t *newest,
+		int fetched, int seen, int dirs, int newdirs, int next)
+{
+	struct mpd_entity *entity;
+	const struct mpd_song *song;
+	const struct mpd_directory *dir;
+	struct mpd_song **copy;
+
+	while ((entity = mpd_recv_entity(conn)) != NULL) {
+		switch (mpd_entity_get_type(entity)) {
+		case MPD_ENTITY_TYPE_SONG:
+			song = mpd_entity_get_song(entity);
+			lua_pushstring(L, mpd_song_get_uri(song));
+			lua_pushnumber(L, mpd_song_get_last_modified(song));
+			lua_rawset(L, seen);
+			if (mpd_song_get_last_modified(song) > *newest)
+				*newest = mpd_song_get_last_modified(song);
+
+			copy = (struct mpd_song **) lua_newuserdata(L, sizeof(struct mpd_song *));
+			luaL_getmetatable(L, MPD_SONG_T);
+			lua_setmetatable(L, -2);
+			*copy = mpd_song_dup(song);
+			if (*copy == NULL)
+				lua_pop(L, 1);
+			else
+				lua_rawseti(L, fetched, lua_objlen(L, fetched) + 1);
+			break;
+		case MPD_ENTITY_TYPE_DIRECTORY:
+			dir = mpd_entity_get_directory(entity);
+			lua_pushstring(L, mpd_directory_get_path(dir));
+			lua_pushnumber(L, mpd_directory_get_last_modified(dir));
+			if (next != 0) {
+				lua_pushvalue(L, -2);
+				lua_rawget(L, dirs);
+				if (!lua_rawequal(L, -1, -2)) {
+					lua_pushvalue(L, -3);
+					lua_rawseti(L, next, lua_objlen(L, next) + 1);
+				}
+				lua_pop(L, 1);
+			}
+			lua_rawset(L, newdirs);
+			break;
+		default:
+			break;
+		}
+		mpd_entity_free(entity);
+	}
+	return mpd_connection_get_error(conn) == MPD_ERROR_SUCCESS;
+}
+
+/* Lists the directories in the array at level in one command list, then
+ * the changed ones below them until none is left, marking each listed one
+ * in listed. */
+static bool lmpdsync_descend(lua_State *L, struct mpd_connection *conn,
+		time_t *newest, int level, int fetched, int seen, int dirs, int newdirs, int listed)
+{
+	int i, n;
+
+	while ((n = lua_objlen(L, level)) > 0) {
+		if (!mpd_command_list_begin(conn, true))
+			return false;
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, level, i);
+			lua_pushvalue(L, -1);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, listed);
+			if (!mpd_send_list_meta(conn, lua_tostring(L, -1))) {
+				lua_pop(L, 1);
+				return false;
+			}
+			lua_pop(L, 1);
+		}
+		if (!mpd_command_list_end(conn))
+			return false;
+
+		/* The next level replaces this one */
+		lua_newtable(L);
+		for (i = 1; i <= n; i++) {
+			if (!lmpdsync_recv(L, conn, newest, fetched, seen, dirs, newdirs,
+						lua_gettop(L))
+					|| (i < n && !mpd_response_next(conn))) {
+				lua_pop(L, 1);
+				return false;
+			}
+		}
+		lua_replace(L, level);
+		if (!mpd_response_finish(conn))
+			return false;
+	}
+	return true;
+}
+
+/* Fetches the songs modified since since wherever they are, which the
+ * descent misses when no directory above them changed. Servers without
+ * modified-since are skipped. */
+static bool lmpdsync_find_modified(lua_State *L, struct mpd_connection *conn,
+		time_t since, time_t *newest, int fetched, int seen, int dirs, int newdirs)
+{
+	char buf[32];
+	const char *argv[2];
+
+	snprintf(buf, sizeof(buf), "%ld", (long) since);
+	argv[0] = "modified-since";
+	argv[1] = buf;
+	if (lmpd_send_argv(conn, "find", 2, argv)
+			&& lmpdsync_recv(L, conn, newest, fetched, seen, dirs, newdirs, 0)
+			&& mpd_response_finish(conn))
+		return true;
+	return mpd_connection_get_error(conn) == MPD_ERROR_SERVER
+		&& mpd_connection_clear_error(conn);
+}
+
+/* Whether the known directory path is gone: it or one of its parents was
+ * missing from the listing of the directory above it. */
+static bool lmpdsync_gone(lua_State *L, const char *path, int newdirs, int listed)
+{
+	bool gone;
+	size_t len, parent;
+
+	gone = false;
+	for (len = strlen(path); !gone && len > 0; len = parent) {
+		for (parent = len; parent > 0 && path[parent - 1] != '/'; parent--)
+			;
+		if (parent > 0)
+			parent--;
+
+		lua_pushlstring(L, path, len);
+		lua_rawget(L, newdirs);
+		if (lua_isnil(L, -1)) {
+			lua_pushlstring(L, path, parent);
+			lua_rawget(L, listed);
+			gone = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	return gone;
+}
+
+/* sync:update(conn) brings the song table up to date, to be called on
+ * MPD_IDLE_DATABASE. Returns the number of added, removed and changed
+ * songs. */
+static int lmpdsync_update(lua_State *L)
+{
+	int i;
+	unsigned added, removed, changed, nevents;
+	time_t newest;
+	struct lmpd_sync *sync;
+	struct mpd_connection **conn;
+	struct mpd_song **song;
+
+	sync = luaL_checkudata(L, 1, MPD_SYNC_T);
+	conn = lmpdconn_check(L, 2);
+	lua_settop(L, 2);
+
+	assert(*conn != NULL);
+
+	/* env at 3, songs at 4, mtimes at 5, dirs at 6, callbacks at 7 */
+	lua_getfenv(L, 1);
+	lua_getfield(L, 3, "songs");
+	lua_getfield(L, 3, "mtimes");
+	lua_getfield(L, 3, "dirs");
+	lua_getfield(L, 3, "callbacks");
+
+	/* fetched songs at 8, seen at 9, newdirs at 10, listed dirs at 11,
+	 * callbacks to call once the table is up to date at 12 */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+
+	newest = sync->newest;
+	if (!sync->primed) {
+		/* Nothing is known yet, take everything in one listing */
+		if (!mpd_send_list_all_meta(*conn, "")
+				|| !lmpdsync_recv(L, *conn, &newest, 8, 9, 6, 10, 0)
+				|| !mpd_response_finish(*conn))
+			goto fail;
+	}
+	else {
+		/* The root has no Last-Modified and is always listed */
+		lua_createtable(L, 1, 0);
+		lua_pushliteral(L, "");
+		lua_rawseti(L, -2, 1);
+		if (!lmpdsync_descend(L, *conn, &newest, lua_gettop(L), 8, 9, 6, 10, 11))
+			goto fail;
+		lua_pop(L, 1);
+		if (!lmpdsync_find_modified(L, *conn, sync->newest, &newest, 8, 9, 6, 10))
+			goto fail;
+
+		/* Directories missing from the listing of their parent are
+		 * gone, with everything in them. */
+		lua_pushnil(L);
+		while (lua_next(L, 6) != 0) {
+			lua_pop(L, 1);
+			if (lmpdsync_gone(L, lua_tostring(L, -1), 10, 11)) {
+				lua_pushvalue(L, -1);
+				lua_pushboolean(L, 1);
+				lua_rawset(L, 11);
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, 6);
+			}
+		}
+	}
+	sync->primed = true;
+	sync->newest = newest;
+
+	lua_pushnil(L);
+	while (lua_next(L, 10) != 0) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, 6);
+	}
+
+	/* Songs missing from the listing of their directory are gone */
+	removed = nevents = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 5) != 0) {
+		lua_pop(L, 1);
+		lmpdsync_push_dirname(L, lua_tostring(L, -1));
+		lua_rawget(L, 11);
+		lua_pushvalue(L, -2);
+		lua_rawget(L, 9);
+		if (lua_isnil(L, -2) || !lua_isnil(L, -1)) {
+			lua_pop(L, 2);
+			continue;
+		}
+		lua_pop(L, 2);
+
+		/* uri, old song */
+		lua_pushvalue(L, -1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 4);
+		lua_pushvalue(L, -2);
+		lua_pushnil(L);
+		lua_rawset(L, 4);
+		lua_pushvalue(L, -2);
+		lua_pushnil(L);
+		lua_rawset(L, 5);
+		sync->count--;
+		removed++;
+		lmpdsync_defer(L, 12, nevents++, "removed");
+	}
+
+	added = changed = 0;
+	for (i = 1; ; i++) {
+		lua_rawgeti(L, 8, i);
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		song = lua_touserdata(L, -1);
+		/* uri, Last-Modified now and before */
+		lua_pushstring(L, mpd_song_get_uri(*song));
+		lua_pushvalue(L, -1);
+		lua_rawget(L, 9);
+		lua_pushvalue(L, -2);
+		lua_rawget(L, 5);
+		if (lua_isnil(L, -1)) {
+			sync->count++;
+			added++;
+			lua_pop(L, 1);
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, 5);
+			lua_pushvalue(L, -1);
+			lua_pushvalue(L, -3);
+			lua_rawset(L, 4);
+			lua_pop(L, 1);
+			lua_pushnil(L);
+			lmpdsync_defer(L, 12, nevents++, "added");
+		}
+		else if (!lua_rawequal(L, -1, -2)) {
+			changed++;
+			lua_pop(L, 1);
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, 5);
+			/* song, uri, old song */
+			lua_pushvalue(L, -1);
+			lua_rawget(L, 4);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -4);
+			lua_rawset(L, 4);
+			lua_remove(L, -2);
+			lmpdsync_defer(L, 12, nevents++, "changed");
+		}
+		else {
+			/* Same song, keep the fresh copy quietly */
+			lua_pop(L, 2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 4);
+			lua_pop(L, 1);
+		}
+	}
+
+	/* The table is consistent now, even if a callback raises an error */
+	lmpdsync_emit(L, 7, 12, nevents);
+
+	lua_pushinteger(L, added);
+	lua_pushinteger(L, removed);
+	lua_pushinteger(L, changed);
+	return 3;
+
+fail:
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, mpd_connection_get_error_message(*conn));
+	return 2;
+}
+
+/* sync:get(uri) returns the song with the given uri or nil */
+static int lmpdsync_get(lua_State *L)
+{
+	luaL_checkudata(L, 1, MPD_SYNC_T);
+	luaL_checkstring(L, 2);
+
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "songs");
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int lmpdsync_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_sync *sync;
+
+	sync = luaL_checkudata(L, 1, MPD_SYNC_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "update", 7) == 0)
+		lua_pushcfunction(L, lmpdsync_update);
+	else if (strncmp(key, "get", 4) == 0)
+		lua_pushcfunction(L, lmpdsync_get);
+	else if (strncmp(key, "songs", 6) == 0) {
+		/* Shared with the sync, not to be modified */
+		lua_getfenv(L, 1);
+		lua_getfield(L, -1, "songs");
+	}
+	else if (strncmp(key, "count", 6) == 0)
+		lua_pushinteger(L, sync->count);
+	else if (strncmp(key, "primed", 7) == 0)
+		lua_pushboolean(L, sync->primed);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static const luaL_reg lreg_sync[] = {
+	{"__index",	lmpdsync_index},
+	{NULL,		NULL},
+};
+
+void linit_sync(lua_State *L)
+{
+	/* Register MPD_SYNC_T metatable */
+	luaL_newmetatable(L, MPD_SYNC_T);
+	luaL_register(L, NULL, lreg_sync);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_sync");
+	lua_pushcfunction(L, lmpdsync_new);
+	lua_settable(L, -3);
+}
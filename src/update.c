@@ -0,0 +1,451 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet autoindent cindent fdm=syntax : */
+
+/* libmpdclient Lua bindings
+   (c) 2010 Ali Polatel <alip@exherbo.org>
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of the Music Player Daemon nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Update scheduler:
+ * Collects the paths passed to request() over a short window and sends
+ * them with flush() as one command list of update commands. Nested paths
+ * are collapsed into their ancestors first. Every request returns a future
+ * which is resolved by on_idle() on MPD_IDLE_UPDATE once the update_id of
+ * the server has moved past the job covering it.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <mpd/connection.h>
+#include <mpd/database.h>
+#include <mpd/idle.h>
+#include <mpd/list.h>
+#include <mpd/response.h>
+#include <mpd/status.h>
+
+#include "globals.h"
+
+/* MPD refuses jobs beyond its update queue size, more than this many
+ * collapsed paths are sent as a single update of the whole database. */
+#define LMPD_UPDATE_JOBS_MAX	32
+
+struct lmpd_update_scheduler {
+	double window;
+	/* monotonic time of the first request since the last flush */
+	double first_at;
+	unsigned npending;
+	unsigned ninflight;
+};
+
+enum lmpd_update_state {
+	LMPD_UPDATE_PENDING,
+	LMPD_UPDATE_SENT,
+	LMPD_UPDATE_DONE,
+};
+
+struct lmpd_update_future {
+	unsigned id;
+	enum lmpd_update_state state;
+};
+
+static int lmpdupdate_new(lua_State *L)
+{
+	double window;
+	struct lmpd_update_scheduler *sched;
+
+	window = luaL_optnumber(L, 1, 0.5);
+	luaL_argcheck(L, window >= 0, 1, "negative window");
+
+	sched = (struct lmpd_update_scheduler *) lua_newuserdata(L, sizeof(struct lmpd_update_scheduler));
+	sched->window = window;
+	sched->first_at = 0;
+	sched->npending = 0;
+	sched->ninflight = 0;
+	luaL_getmetatable(L, MPD_UPDATESCHEDULER_T);
+	lua_setmetatable(L, -2);
+
+	/* pending maps paths to arrays of futures, inflight holds the sent ones */
+	lua_createtable(L, 0, 2);
+	lua_newtable(L);
+	lua_setfield(L, -2, "pending");
+	lua_newtable(L);
+	lua_setfield(L, -2, "inflight");
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+/* sched:request(path) queues path for the next flush, returns a future */
+static int lmpdupdate_request(lua_State *L)
+{
+	size_t len;
+	const char *path;
+	struct lmpd_update_scheduler *sched;
+	struct lmpd_update_future *future;
+
+	sched = luaL_checkudata(L, 1, MPD_UPDATESCHEDULER_T);
+	path = luaL_optlstring(L, 2, "", &len);
+	lua_settop(L, 2);
+
+	/* The same directory may be spelled with a trailing slash */
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+
+	/* pending at 3, futures of path at 4 */
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, "pending");
+	lua_replace(L, 3);
+	lua_pushlstring(L, path, len);
+	lua_rawget(L, 3);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlstring(L, path, len);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 3);
+		sched->npending++;
+	}
+
+	if (sched->npending == 1 && lua_objlen(L, 4) == 0)
+		sched->first_at = lmpd_monotonic();
+
+	future = (struct lmpd_update_future *) lua_newuserdata(L, sizeof(struct lmpd_update_future));
+	future->id = 0;
+	future->state = LMPD_UPDATE_PENDING;
+	luaL_getmetatable(L, MPD_UPDATEFUTURE_T);
+	lua_setmetatable(L, -2);
+
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, 4, lua_objlen(L, 4) + 1);
+
+	return 1;
+}
+
+/* Orders '/' before every other byte so that descendants follow their
+ * ancestor directly once sorted. */
+static int lmpdupdate_pathcmp(const void *a, const void *b)
+{
+	const unsigned char *x = *(const unsigned char *const *) a;
+	const unsigned char *y = *(const unsigned char *const *) b;
+	unsigned cx, cy;
+
+	for (;; x++, y++) {
+		cx = *x == '/' ? 1 : *x;
+		cy = *y == '/' ? 1 : *y;
+		if (cx != cy || cx == 0)
+			return (int) cx - (int) cy;
+	}
+}
+
+/* Whether path is ancestor or equal to the path it is compared with */
+static bool lmpdupdate_covers(const char *ancestor, const char *path)
+{
+	size_t len;
+
+	len = strlen(ancestor);
+	if (len == 0)
+		return true;
+	return strncmp(ancestor, path, len) == 0
+		&& (path[len] == '\0' || path[len] == '/');
+}
+
+/* sched:due() returns the seconds left until the window closes, zero when
+ * flush() should be called now and nil when nothing is pending. */
+static int lmpdupdate_due(lua_State *L)
+{
+	double left;
+	struct lmpd_update_scheduler *sched;
+
+	sched = luaL_checkudata(L, 1, MPD_UPDATESCHEDULER_T);
+
+	if (sched->npending == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	left = sched->first_at + sched->window - lmpd_monotonic();
+	lua_pushnumber(L, left > 0 ? left : 0);
+	return 1;
+}
+
+/* sched:flush(conn[, force]) sends the pending paths once the window has
+ * closed, or right away with force. Returns the number of update jobs
+ * sent. */
+static int lmpdupdate_flush(lua_State *L)
+{
+	bool whole;
+	unsigned i, j, n, njobs;
+	unsigned *job, *ids;
+	const char **paths;
+	struct lmpd_update_scheduler *sched;
+	struct lmpd_update_future *future;
+	struct mpd_connection **conn;
+
+	sched = luaL_checkudata(L, 1, MPD_UPDATESCHEDULER_T);
+	conn = lmpdconn_check(L, 2);
+	lua_settop(L, 3);
+
+	assert(*conn != NULL);
+
+	if (sched->npending == 0 || (!lua_toboolean(L, 3)
+				&& lmpd_monotonic() < sched->first_at + sched->window)) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	/* pending at 5, inflight at 6 */
+	lua_getfenv(L, 1);
+	lua_getfield(L, 4, "pending");
+	lua_getfield(L, 4, "inflight");
+
+	/* Scratch arrays at 7, the path strings stay referenced by pending */
+	n = sched->npending;
+	paths = lua_newuserdata(L, n * (sizeof(const char *) + 2 * sizeof(unsigned)));
+	job = (unsigned *)(paths + n);
+	ids = job + n;
+
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, 5) != 0) {
+		lua_pop(L, 1);
+		assert(i < n);
+		paths[i++] = lua_tostring(L, -1);
+	}
+	qsort(paths, n, sizeof(const char *), lmpdupdate_pathcmp);
+
+	/* Collapse, job[i] is the index of the path covering paths[i] */
+	njobs = 0;
+	for (i = 0; i < n; i++) {
+		if (njobs > 0 && lmpdupdate_covers(paths[job[i - 1]], paths[i]))
+			job[i] = job[i - 1];
+		else {
+			job[i] = i;
+			njobs++;
+		}
+	}
+	whole = njobs > LMPD_UPDATE_JOBS_MAX;
+	if (whole) {
+		for (i = 0; i < n; i++)
+			job[i] = 0;
+		njobs = 1;
+	}
+
+	if (!mpd_command_list_begin(*conn, true))
+		goto fail;
+	for (i = 0; i < n; i++) {
+		if (job[i] != i)
+			continue;
+		if (!mpd_send_update(*conn, !whole && *paths[i] != '\0' ? paths[i] : NULL))
+			goto fail;
+	}
+	if (!mpd_command_list_end(*conn))
+		goto fail;
+
+	j = 0;
+	for (i = 0; i < n; i++) {
+		if (job[i] != i)
+			continue;
+		ids[i] = mpd_recv_update_id(*conn);
+		if (ids[i] == 0)
+			goto fail;
+		if (++j < njobs && !mpd_response_next(*conn))
+			goto fail;
+	}
+	if (!mpd_response_finish(*conn))
+		goto fail;
+
+	/* Hand the job ids to the futures and move them to inflight */
+	for (i = 0; i < n; i++) {
+		lua_pushstring(L, paths[i]);
+		lua_rawget(L, 5);
+		for (j = 1; ; j++) {
+			lua_rawgeti(L, -1, j);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			future = lua_touserdata(L, -1);
+			future->id = ids[job[i]];
+			future->state = LMPD_UPDATE_SENT;
+			lua_rawseti(L, 6, ++sched->ninflight);
+		}
+		lua_pop(L, 1);
+	}
+
+	lua_newtable(L);
+	lua_setfield(L, 4, "pending");
+	sched->npending = 0;
+
+	lua_pushinteger(L, njobs);
+	return 1;
+
+fail:
+	/* The requests stay pending for the next flush */
+	/* Push nil and error message */
+	lua_pushnil(L);
+	lua_pushstring(L, mpd_connection_get_error_message(*conn));
+	return 2;
+}
+
+/* sched:on_idle(conn, mask) resolves the futures whose jobs have finished.
+ * Returns the number of futures resolved. */
+static int lmpdupdate_on_idle(lua_State *L)
+{
+	int idle;
+	unsigned i, n, current, resolved;
+	struct lmpd_update_scheduler *sched;
+	struct lmpd_update_future *future;
+	struct mpd_connection **conn;
+	struct mpd_status *status;
+
+	sched = luaL_checkudata(L, 1, MPD_UPDATESCHEDULER_T);
+	conn = lmpdconn_check(L, 2);
+	idle = luaL_checkinteger(L, 3);
+	lua_settop(L, 3);
+
+	assert(*conn != NULL);
+
+	if (!(idle & MPD_IDLE_UPDATE) || sched->ninflight == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	status = mpd_run_status(*conn);
+	if (status == NULL) {
+		/* Push nil and error message */
+		lua_pushnil(L);
+		lua_pushstring(L, mpd_connection_get_error_message(*conn));
+		return 2;
+	}
+	/* The job running now, zero when the server is idle */
+	current = mpd_status_get_update_id(status);
+	mpd_status_free(status);
+
+	/* inflight at 5, the unresolved futures are packed to the front */
+	lua_getfenv(L, 1);
+	lua_getfield(L, 4, "inflight");
+	resolved = n = 0;
+	for (i = 1; i <= sched->ninflight; i++) {
+		lua_rawgeti(L, 5, i);
+		future = lua_touserdata(L, -1);
+		if (current == 0 || future->id < current) {
+			future->state = LMPD_UPDATE_DONE;
+			resolved++;
+			lua_pop(L, 1);
+		}
+		else
+			lua_rawseti(L, 5, ++n);
+	}
+	for (i = n + 1; i <= sched->ninflight; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, 5, i);
+	}
+	sched->ninflight = n;
+
+	lua_pushinteger(L, resolved);
+	return 1;
+}
+
+static int lmpdupdate_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_update_scheduler *sched;
+
+	sched = luaL_checkudata(L, 1, MPD_UPDATESCHEDULER_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "request", 8) == 0)
+		lua_pushcfunction(L, lmpdupdate_request);
+	else if (strncmp(key, "due", 4) == 0)
+		lua_pushcfunction(L, lmpdupdate_due);
+	else if (strncmp(key, "flush", 6) == 0)
+		lua_pushcfunction(L, lmpdupdate_flush);
+	else if (strncmp(key, "on_idle", 8) == 0)
+		lua_pushcfunction(L, lmpdupdate_on_idle);
+	else if (strncmp(key, "window", 7) == 0)
+		lua_pushnumber(L, sched->window);
+	else if (strncmp(key, "pending", 8) == 0)
+		lua_pushinteger(L, sched->npending);
+	else if (strncmp(key, "inflight", 9) == 0)
+		lua_pushinteger(L, sched->ninflight);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static int lmpdupdatefuture_index(lua_State *L)
+{
+	const char *key;
+	struct lmpd_update_future *future;
+
+	future = luaL_checkudata(L, 1, MPD_UPDATEFUTURE_T);
+	key = luaL_checkstring(L, 2);
+
+	if (strncmp(key, "done", 5) == 0)
+		lua_pushboolean(L, future->state == LMPD_UPDATE_DONE);
+	else if (strncmp(key, "sent", 5) == 0)
+		lua_pushboolean(L, future->state != LMPD_UPDATE_PENDING);
+	else if (strncmp(key, "id", 3) == 0)
+		lua_pushinteger(L, future->id);
+	else
+		return luaL_error(L, "Invalid key `%s'", key);
+	return 1;
+}
+
+static const luaL_reg lreg_update[] = {
+	{"__index",	lmpdupdate_index},
+	{NULL,		NULL},
+};
+
+static const luaL_reg lreg_updatefuture[] = {
+	{"__index",	lmpdupdatefuture_index},
+	{NULL,		NULL},
+};
+
+void linit_update(lua_State *L)
+{
+	/* Register MPD_UPDATESCHEDULER_T metatable */
+	luaL_newmetatable(L, MPD_UPDATESCHEDULER_T);
+	luaL_register(L, NULL, lreg_update);
+	lua_pop(L, 1);
+
+	/* Register MPD_UPDATEFUTURE_T metatable */
+	luaL_newmetatable(L, MPD_UPDATEFUTURE_T);
+	luaL_register(L, NULL, lreg_updatefuture);
+	lua_pop(L, 1);
+
+	lua_pushliteral(L, "new_update_scheduler");
+	lua_pushcfunction(L, lmpdupdate_new);
+	lua_settable(L, -3);
+}